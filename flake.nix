@@ -22,6 +22,7 @@
 
           pkg-config
           pipewire
+          libsndfile
         ];
 
         shellHook = ''
@@ -40,11 +41,12 @@
           buildInputs = with pkgs; [
             pkg-config
             pipewire
+            libsndfile
           ];
 
 
           build = "RELEASE";
-          buildPhase = "make BUILD=$build";
+          buildPhase = "make BUILD=$build WITH_SNDFILE=1";
           installPhase = ''
             mkdir -p $out/bin
             cp bin/mbas $out/bin/
@@ -0,0 +1,128 @@
+// Memory saved by `single_sample.encoding` against the CPU it costs: renders
+// voices from the same sample kept as f32, s16 and IMA ADPCM through
+// `voice_render`, as `on_process` does, and reports the bytes the sample
+// takes and the time per rendered frame of each voice. Voices restart on a
+// random step when they end, at rate 1.0, and pitched up, which goes through
+// the interpolation and, for encoded samples, a decoded copy of each block.
+//
+// make bench && ./bin/bench-encoding [voices] [seconds]
+
+#define _GNU_SOURCE
+
+#include <spa/utils/defs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../voice.c"
+
+#define BENCH_RATE 44100
+// Length of the sample and of its steps
+#define BENCH_SAMPLE_SECONDS 30
+#define BENCH_STEP_FRAMES (BENCH_RATE / 4)
+// Frames rendered per voice at once, a typical quantum
+#define BENCH_BLOCK 256
+
+static double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// A hit every step: a decaying tone with some noise on its attack, so ADPCM
+// sees both smooth and sharp parts
+static void make_sample(float *x, size_t n) {
+  uint32_t noise = 1;
+  for (size_t i = 0; i < n; i++) {
+    size_t step = i / BENCH_STEP_FRAMES;
+    double t = (double)(i % BENCH_STEP_FRAMES) / BENCH_RATE;
+    double pitch = 110.0 * (1.0 + (double)(step % 7) / 4.0);
+    noise = noise * 1664525u + 1013904223u;
+    double hiss = ((double)(noise >> 8) / (1 << 24) - 0.5) * exp(-t * 60.0);
+    x[i] = (float)(0.6 * sin(2.0 * M_PI * pitch * t) * exp(-t * 8.0) +
+                   0.3 * hiss);
+  }
+}
+
+static void start_random_step(voice *v, size_t steps, double rate) {
+  size_t step = (size_t)rand() % steps;
+  voice_start(v, step * BENCH_STEP_FRAMES, (step + 1) * BENCH_STEP_FRAMES,
+              rate, 1.0f, 1.0);
+}
+
+// Nanoseconds per voice-frame rendering `voices` voices for `frames` frames
+static double render(const Data *data, voice *voices, size_t count,
+                     size_t frames, double rate) {
+  size_t steps = data->sample_length / BENCH_STEP_FRAMES;
+  float out[BENCH_BLOCK];
+  volatile float sink = 0.0f;
+
+  srand(1);
+  for (size_t i = 0; i < count; i++) {
+    start_random_step(&voices[i], steps, rate);
+  }
+
+  double start = seconds();
+  for (size_t done = 0; done < frames; done += BENCH_BLOCK) {
+    for (size_t i = 0; i < count; i++) {
+      uint32_t n = voice_render(&voices[i], data, out, BENCH_BLOCK);
+      if (n < BENCH_BLOCK) {
+        start_random_step(&voices[i], steps, rate);
+        voice_render(&voices[i], data, out + n, BENCH_BLOCK - n);
+      }
+      sink += out[0];
+    }
+  }
+  double elapsed = seconds() - start;
+  (void)sink;
+
+  return elapsed / (double)(count * frames) * 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = argc > 1 ? (size_t)atoi(argv[1]) : 16;
+  size_t frames = (size_t)(argc > 2 ? atof(argv[2]) : 10.0) * BENCH_RATE;
+  const char *names[] = {"f32", "s16", "adpcm"};
+  const SampleEncoding encodings[] = {ENCODING_F32, ENCODING_S16,
+                                      ENCODING_ADPCM};
+  size_t length = BENCH_SAMPLE_SECONDS * BENCH_RATE;
+
+  voice *voices = (voice *)calloc(count, sizeof(voice));
+  float *source = (float *)malloc(length * sizeof(float));
+  if (count == 0 || !voices || !source) {
+    fprintf(stderr, "Failed to allocate %zu voices\n", count);
+    return EXIT_FAILURE;
+  }
+  make_sample(source, length);
+  voice_init(INTERP_CUBIC);
+
+  printf("%zu voices, %zu s sample, cubic interpolation\n", count,
+         (size_t)BENCH_SAMPLE_SECONDS);
+  for (size_t e = 0; e < sizeof(encodings) / sizeof(encodings[0]); e++) {
+    Data data = {.sample_fd = -1, .sample_length = length};
+    data.sample = (float *)malloc(length * sizeof(float));
+    if (!data.sample) {
+      fprintf(stderr, "Failed to allocate the sample\n");
+      return EXIT_FAILURE;
+    }
+    memcpy(data.sample, source, length * sizeof(float));
+    if (!encode_sample(&data, encodings[e])) {
+      fprintf(stderr, "Failed to encode the sample as %s\n", names[e]);
+      return EXIT_FAILURE;
+    }
+
+    double plain = render(&data, voices, count, frames, 1.0);
+    double pitched = render(&data, voices, count, frames, 1.5);
+    printf("%-6s %9zu bytes (%5.1f%%), %5.3f bytes per frame, "
+           "%6.2f ns per voice-frame at rate 1.0, %6.2f at 1.5\n",
+           names[e], sample_size(&data),
+           100.0 * (double)sample_size(&data) /
+               (double)(length * sizeof(float)),
+           (double)sample_size(&data) / (double)length, plain, pitched);
+    free_sample(&data);
+  }
+
+  free(source);
+  free(voices);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+// What `memory.huge_pages` saves when steps far apart are played one after
+// the other: starts random steps of a large sample and renders their first
+// quantum through `voice_render`, from the sample on regular pages and once
+// moved to huge pages by `move_sample_to_huge_pages`. Reports the time per
+// step start and, where perf events are available, the dTLB misses.
+//
+// make bench && ./bin/bench-hugepages [megabytes] [steps]
+
+#define _GNU_SOURCE
+
+#include <linux/perf_event.h>
+#include <spa/utils/defs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "../voice.c"
+
+// Frames rendered at the start of each step, a typical quantum
+#define BENCH_BLOCK 256
+
+static double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Counter of the dTLB read misses of this thread, or -1 if perf events are
+// not available
+static int open_dtlb_misses(void) {
+  struct perf_event_attr attr = {
+      .type = PERF_TYPE_HW_CACHE,
+      .size = sizeof(attr),
+      .config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+      .disabled = 1,
+      .exclude_kernel = 1,
+      .exclude_hv = 1,
+  };
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Renders the first `BENCH_BLOCK` frames of `steps` random steps of `data`,
+// printing the time and the dTLB misses per step start
+static void run(const char *name, const Data *data, voice *v, size_t steps,
+                int counter) {
+  float out[BENCH_BLOCK];
+  volatile float sink = 0.0f;
+  size_t range = data->sample_length - BENCH_BLOCK;
+  uint64_t state = 1;
+
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  double start = seconds();
+  for (size_t i = 0; i < steps; i++) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    size_t from = (size_t)(state >> 33) % range;
+    voice_start(v, from, from + BENCH_BLOCK, 1.0, 1.0f, 1.0);
+    voice_render(v, data, out, BENCH_BLOCK);
+    sink += out[0];
+  }
+  double elapsed = seconds() - start;
+  (void)sink;
+
+  uint64_t misses = 0;
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+      counter = -1;
+    }
+  }
+
+  printf("%-12s %7.1f ns per step start", name,
+         elapsed / (double)steps * 1e9);
+  if (counter >= 0) {
+    printf(", %5.2f dTLB misses per step start",
+           (double)misses / (double)steps);
+  }
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  size_t megabytes = argc > 1 ? (size_t)atoi(argv[1]) : 512;
+  size_t steps = argc > 2 ? (size_t)atol(argv[2]) : 2000000;
+  size_t size = megabytes << 20;
+
+  // Regular pages, even where transparent huge pages are always on
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (size < HUGE_PAGE_SIZE || map == MAP_FAILED) {
+    fprintf(stderr, "Failed to allocate %zu MB\n", megabytes);
+    return EXIT_FAILURE;
+  }
+  madvise(map, size, MADV_NOHUGEPAGE);
+
+  Data data = {.sample_fd = -1, .sample_length = size / sizeof(float)};
+  use_sample_map(&data, map, size, -1, 0);
+  for (size_t i = 0; i < data.sample_length; i++) {
+    data.sample[i] = (float)(i % 1000) / 1000.0f;
+  }
+
+  voice *v = (voice *)calloc(1, sizeof(voice));
+  if (!v) {
+    fprintf(stderr, "Failed to allocate the voice\n");
+    return EXIT_FAILURE;
+  }
+  voice_init(INTERP_CUBIC);
+
+  int counter = open_dtlb_misses();
+  if (counter < 0) {
+    perror("perf_event_open, not counting dTLB misses");
+  }
+
+  printf("%zu MB sample, %zu random step starts of %d frames\n", megabytes,
+         steps, BENCH_BLOCK);
+  run("4 KB pages", &data, v, steps, counter);
+
+  move_sample_to_huge_pages(&data);
+  if (data.sample_map == map) {
+    return EXIT_FAILURE;
+  }
+  run("huge pages", &data, v, steps, counter);
+
+  free_sample(&data);
+  free(v);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,184 @@
+// Compares the two ways mbas reads the command socket: `recvmmsg`, as in
+// `on_msg`, and the multishot io_uring receive of uring.c. A child process
+// sends bursts of PLAYs and waits for a reply after each, like a client
+// asking for acks, so the time per datagram covers the wake-ups too.
+//
+// make bench && ./bin/bench-recv [datagrams]
+
+#define _GNU_SOURCE
+#define MBAS_WITH_IO_URING
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../uring.c"
+
+// As in main.c
+#define RECV_BATCH 16
+
+static int received;
+
+static socklen_t abstract_address(struct sockaddr_un *addr, const char *name) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path + 1, name);
+  return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 +
+                     strlen(name));
+}
+
+// Same buffers as `on_msg`
+static void receive_recvmmsg(int fd) {
+  char buffers[RECV_BATCH][256];
+  struct sockaddr_un addrs[RECV_BATCH];
+  union {
+    char buffer[CMSG_SPACE(sizeof(struct ucred))];
+    struct cmsghdr align;
+  } controls[RECV_BATCH];
+  struct iovec iovs[RECV_BATCH];
+  struct mmsghdr msgs[RECV_BATCH];
+
+  for (int i = 0; i < RECV_BATCH; i++) {
+    iovs[i].iov_base = buffers[i];
+    iovs[i].iov_len = sizeof(buffers[i]) - 1;
+    msgs[i].msg_hdr = (struct msghdr){
+        .msg_name = &addrs[i],
+        .msg_namelen = sizeof(addrs[i]),
+        .msg_iov = &iovs[i],
+        .msg_iovlen = 1,
+        .msg_control = controls[i].buffer,
+        .msg_controllen = sizeof(controls[i].buffer),
+    };
+  }
+
+  int count = recvmmsg(fd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+  for (int i = 0; i < count; i++) {
+    buffers[i][msgs[i].msg_len] = '\0';
+    received++;
+  }
+}
+
+static void count_datagram(void *userdata, datagram *d) { received++; }
+
+static double seconds(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Sends `rounds` bursts of `burst` PLAYs to `server`, waiting for a reply
+// after each
+static void send_bursts(const char *name, struct sockaddr_un *server,
+                        socklen_t server_len, int burst, int rounds) {
+  struct sockaddr_un addr;
+  socklen_t addr_len = abstract_address(&addr, name);
+  int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, addr_len) < 0) {
+    perror("client socket");
+    _exit(EXIT_FAILURE);
+  }
+
+  char play[64];
+  for (int k = 0; k < rounds; k++) {
+    for (int i = 0; i < burst; i++) {
+      int len = snprintf(play, sizeof(play), "PLAY seq=%d rate=1.0", i);
+      sendto(fd, play, (size_t)len, 0, (struct sockaddr *)server, server_len);
+    }
+    char reply;
+    recv(fd, &reply, 1, 0);
+  }
+  _exit(EXIT_SUCCESS);
+}
+
+static void run(bool uring, int burst, int rounds) {
+  static int run_id;
+  char server_name[32], client_name[32];
+  snprintf(server_name, sizeof(server_name), "mbas-bench-%d-%d", getpid(),
+           run_id);
+  snprintf(client_name, sizeof(client_name), "mbas-bench-client-%d-%d",
+           getpid(), run_id++);
+
+  struct sockaddr_un server, client;
+  socklen_t server_len = abstract_address(&server, server_name);
+  socklen_t client_len = abstract_address(&client, client_name);
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  int passcred = 1;
+  if (fd < 0 || bind(fd, (struct sockaddr *)&server, server_len) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &passcred,
+                 sizeof(passcred)) < 0) {
+    perror("server socket");
+    exit(EXIT_FAILURE);
+  }
+
+  datagram_uring u;
+  int poll_fd = fd;
+  if (uring) {
+    if (!datagram_uring_init(&u, fd)) {
+      fprintf(stderr, "io_uring receive not available\n");
+      exit(EXIT_FAILURE);
+    }
+    poll_fd = datagram_uring_fd(&u);
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    send_bursts(client_name, &server, server_len, burst, rounds);
+  }
+
+  received = 0;
+  long syscalls = 0;
+  double wall = 0.0, cpu = 0.0;
+  for (int k = 0; k < rounds; k++) {
+    while (received < (k + 1) * burst) {
+      struct pollfd p = {.fd = poll_fd, .events = POLLIN};
+      poll(&p, 1, -1);
+      syscalls++;
+      // From the first datagram on, without the start of the child
+      if (wall == 0.0) {
+        wall = seconds(CLOCK_MONOTONIC);
+        cpu = seconds(CLOCK_PROCESS_CPUTIME_ID);
+      }
+      if (uring) {
+        datagram_uring_drain(&u, count_datagram, NULL);
+      } else {
+        receive_recvmmsg(fd);
+        syscalls++;
+      }
+    }
+    sendto(fd, "", 1, 0, (struct sockaddr *)&client, client_len);
+    syscalls++;
+  }
+  wall = seconds(CLOCK_MONOTONIC) - wall;
+  cpu = seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+  waitpid(pid, NULL, 0);
+
+  printf("%-8s burst %2d: %5.2f us per datagram, %5.2f us of receiver CPU, "
+         "%.2f syscalls\n",
+         uring ? "io_uring" : "recvmmsg", burst, wall / received * 1e6,
+         cpu / received * 1e6, (double)syscalls / received);
+
+  if (uring) {
+    datagram_uring_free(&u);
+  }
+  close(fd);
+}
+
+int main(int argc, char *argv[]) {
+  int datagrams = argc > 1 ? atoi(argv[1]) : 100000;
+  // Bursts stay under the default net.unix.max_dgram_qlen of 10, past which
+  // the sender blocks
+  const int bursts[] = {1, 4, 10};
+
+  for (size_t i = 0; i < sizeof(bursts) / sizeof(bursts[0]); i++) {
+    run(false, bursts[i], datagrams / bursts[i]);
+    run(true, bursts[i], datagrams / bursts[i]);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+#ifndef MBAS_CACHE_C
+#define MBAS_CACHE_C
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk cache of sample images, keyed by a 64-bit hash of whatever they
+// were derived from.
+
+#define CACHE_KEY_INIT 0xcbf29ce484222325ULL
+
+// FNV-1a, fed incrementally
+static uint64_t cache_key_add(uint64_t key, const void *bytes, size_t len) {
+  const unsigned char *p = bytes;
+  for (size_t i = 0; i < len; i++) {
+    key ^= p[i];
+    key *= 0x100000001b3ULL;
+  }
+  return key;
+}
+
+// Adds the identity of the file at `path` (path, size and mtime) to `key`.
+// Returns false if it cannot be stat'ed.
+static bool cache_key_add_file(uint64_t *key, const char *path) {
+  struct stat st;
+  if (stat(path, &st) < 0) {
+    return false;
+  }
+
+  int64_t identity[3] = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+  *key = cache_key_add(*key, path, strlen(path));
+  *key = cache_key_add(*key, identity, sizeof(identity));
+  return true;
+}
+
+// Adds a hash of the first and last `CACHE_CONTENT_SPAN` bytes of the file at
+// `path` to `key`. Cheap even for long files, and together with the mtime
+// enough to notice a file that was replaced.
+#define CACHE_CONTENT_SPAN (64 * 1024)
+
+static bool cache_key_add_content(uint64_t *key, const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return false;
+  }
+
+  static unsigned char buffer[CACHE_CONTENT_SPAN];
+  off_t offsets[2] = {0, st.st_size > CACHE_CONTENT_SPAN
+                             ? st.st_size - CACHE_CONTENT_SPAN
+                             : 0};
+  for (int i = 0; i < 2; i++) {
+    ssize_t n = pread(fd, buffer, sizeof(buffer), offsets[i]);
+    if (n < 0) {
+      close(fd);
+      return false;
+    }
+    *key = cache_key_add(*key, buffer, (size_t)n);
+  }
+
+  close(fd);
+  return true;
+}
+
+// Creates `dir` and its parents.
+static bool cache_mkdir(const char *dir) {
+  char path[4096];
+  size_t len = strlen(dir);
+  if (len == 0 || len >= sizeof(path)) {
+    return false;
+  }
+  memcpy(path, dir, len + 1);
+
+  for (char *p = path + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        return false;
+      }
+      *p = '/';
+    }
+  }
+  return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+// `<dir>/<kind>-<key>.raw`
+static void cache_path(char *out, size_t size, const char *dir,
+                       const char *kind, uint64_t key) {
+  snprintf(out, size, "%s/%s-%016llx.raw", dir, kind, (unsigned long long)key);
+}
+
+// Whether the image behind `fd` can be trusted: a regular file of ours that
+// nobody else can write, so another user cannot feed us a forged one through
+// a shared directory like /dev/shm, and exactly `size` bytes long.
+static bool cache_trusted(int fd, size_t size) {
+  struct stat st;
+  return fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+         st.st_uid == geteuid() && !(st.st_mode & (S_IWGRP | S_IWOTH)) &&
+         (size_t)st.st_size == size;
+}
+
+// Opens the image at `path` for reading if it is trusted, see
+// `cache_trusted`. Returns -1 otherwise.
+static int cache_open(const char *path, size_t size) {
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd >= 0 && !cache_trusted(fd, size)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Reads the cached image at `path` into `buffer` if it is exactly `size`
+// bytes long.
+static bool cache_read(const char *path, void *buffer, size_t size) {
+  int fd = cache_open(path, size);
+  if (fd < 0) {
+    return false;
+  }
+
+  bool ok = true;
+  for (size_t done = 0; ok && done < size;) {
+    ssize_t n = pread(fd, (char *)buffer + done, size - done, (off_t)done);
+    ok = n > 0;
+    done += ok ? (size_t)n : 0;
+  }
+
+  close(fd);
+  return ok;
+}
+
+// Writes `buffer` to `path` through a temporary file, so a reader never sees
+// a partial image. Failing to cache is not fatal, so it only warns.
+static void cache_write(const char *dir, const char *path, const void *buffer,
+                        size_t size) {
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+
+  if (!cache_mkdir(dir)) {
+    fprintf(stderr, "Failed to create cache directory: %s\n", dir);
+    return;
+  }
+
+  // Never through a file or link someone else left under that name
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                0644);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to write cache file: %s\n", tmp);
+    return;
+  }
+
+  bool ok = true;
+  for (size_t done = 0; ok && done < size;) {
+    ssize_t n = write(fd, (const char *)buffer + done, size - done);
+    ok = n > 0;
+    done += ok ? (size_t)n : 0;
+  }
+
+  if (close(fd) < 0 || !ok || rename(tmp, path) < 0) {
+    fprintf(stderr, "Failed to write cache file: %s\n", path);
+    unlink(tmp);
+  }
+}
+
+#endif
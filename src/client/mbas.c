@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+
+#include "mbas.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Messages handed to each sendmmsg in `mbas_send_many`, and read by each
+// recvmmsg in `mbas_recv_acks`
+#define SEND_BATCH 64
+
+struct mbas_client {
+  int fd;
+};
+
+struct mbas_ring_writer {
+  struct mbas_ring *ring;
+  int eventfd;
+};
+
+mbas_client *mbas_connect(const char *path) {
+  if (!path) {
+    path = MBAS_DEFAULT_SOCKET;
+  }
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  strcpy(addr.sun_path, path);
+
+  mbas_client *client = malloc(sizeof(mbas_client));
+  if (!client) {
+    return NULL;
+  }
+
+  client->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (client->fd < 0) {
+    goto free_client;
+  }
+
+  // Binding only the family picks a free abstract address
+  struct sockaddr_un local = {.sun_family = AF_UNIX};
+  if (bind(client->fd, (struct sockaddr *)&local, sizeof(sa_family_t)) < 0 ||
+      connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    goto close_socket;
+  }
+  return client;
+
+close_socket:;
+  int saved = errno;
+  close(client->fd);
+  errno = saved;
+free_client:
+  free(client);
+  return NULL;
+}
+
+void mbas_disconnect(mbas_client *client) {
+  if (client) {
+    close(client->fd);
+    free(client);
+  }
+}
+
+int mbas_fd(const mbas_client *client) { return client->fd; }
+
+int mbas_play(mbas_client *client, const struct mbas_command *command) {
+  if (send(client->fd, command, sizeof(*command), 0) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int mbas_send_many(mbas_client *client, const struct mbas_command *commands,
+                   size_t count) {
+  struct iovec iovs[SEND_BATCH];
+  struct mmsghdr msgs[SEND_BATCH];
+  size_t sent = 0;
+
+  while (sent < count) {
+    size_t batch = count - sent < SEND_BATCH ? count - sent : SEND_BATCH;
+    for (size_t i = 0; i < batch; i++) {
+      iovs[i].iov_base = (void *)&commands[sent + i];
+      iovs[i].iov_len = sizeof(struct mbas_command);
+      msgs[i].msg_hdr = (struct msghdr){.msg_iov = &iovs[i], .msg_iovlen = 1};
+    }
+
+    int n = sendmmsg(client->fd, msgs, (unsigned int)batch, 0);
+    if (n < 0) {
+      return sent > 0 ? (int)sent : -1;
+    }
+    sent += (size_t)n;
+    if ((size_t)n < batch) {
+      break;
+    }
+  }
+  return (int)sent;
+}
+
+// Whether the datagram `buffer`, `n` bytes long, is a binary ack
+static bool is_ack(const void *buffer, size_t n) {
+  return n == sizeof(struct mbas_ack) &&
+         *(const uint8_t *)buffer == MBAS_REPLY_ACK;
+}
+
+int mbas_recv_acks(mbas_client *client, struct mbas_ack *acks, size_t max) {
+  struct iovec iovs[SEND_BATCH];
+  struct mmsghdr msgs[SEND_BATCH];
+  size_t count = 0;
+
+  while (count < max) {
+    size_t batch = max - count < SEND_BATCH ? max - count : SEND_BATCH;
+    for (size_t i = 0; i < batch; i++) {
+      iovs[i].iov_base = &acks[count + i];
+      iovs[i].iov_len = sizeof(struct mbas_ack);
+      msgs[i].msg_hdr = (struct msghdr){.msg_iov = &iovs[i], .msg_iovlen = 1};
+    }
+
+    int n = recvmmsg(client->fd, msgs, (unsigned int)batch, MSG_DONTWAIT,
+                     NULL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return count > 0 ? (int)count : -1;
+    }
+
+    // Keeps the acks, and drops any other reply in between
+    size_t kept = count;
+    for (int i = 0; i < n; i++) {
+      if (is_ack(&acks[count + i], msgs[i].msg_len) &&
+          !(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+        acks[kept++] = acks[count + i];
+      }
+    }
+    count = kept;
+    if ((size_t)n < batch) {
+      break;
+    }
+  }
+  return (int)count;
+}
+
+int mbas_send(mbas_client *client, const char *text) {
+  if (send(client->fd, text, strlen(text), 0) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+// Waits up to `timeout_ms` for a datagram, returning 0 when one is there
+static int wait_reply(mbas_client *client, int timeout_ms) {
+  struct pollfd pfd = {.fd = client->fd, .events = POLLIN};
+  int res = poll(&pfd, 1, timeout_ms);
+  if (res == 0) {
+    errno = ETIMEDOUT;
+  }
+  return res > 0 ? 0 : -1;
+}
+
+int mbas_request(mbas_client *client, const char *text, char *reply,
+                 size_t size, int timeout_ms) {
+  if (size == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (mbas_send(client, text) < 0) {
+    return -1;
+  }
+
+  ssize_t n;
+  do {
+    if (wait_reply(client, timeout_ms) < 0) {
+      return -1;
+    }
+    n = recv(client->fd, reply, size - 1, 0);
+    if (n < 0) {
+      return -1;
+    }
+  } while (is_ack(reply, (size_t)n));
+  reply[n] = '\0';
+  return (int)n;
+}
+
+int mbas_latency(mbas_client *client, int64_t *latency_ns, int timeout_ms) {
+  char reply[128];
+  if (mbas_request(client, "LATENCY", reply, sizeof(reply), timeout_ms) < 0) {
+    return -1;
+  }
+
+  long long latency;
+  if (sscanf(reply, "LATENCY latency=%lld", &latency) != 1) {
+    // Not started yet
+    errno = EAGAIN;
+    return -1;
+  }
+  *latency_ns = latency;
+  return 0;
+}
+
+mbas_ring_writer *mbas_ring_open(mbas_client *client, int timeout_ms) {
+  if (mbas_send(client, "RING") < 0) {
+    return NULL;
+  }
+
+  char reply[64];
+  int fds[2] = {-1, -1};
+  union {
+    char buffer[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {.iov_base = reply, .iov_len = sizeof(reply) - 1};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buffer,
+      .msg_controllen = sizeof(control.buffer),
+  };
+  ssize_t n;
+  do {
+    if (wait_reply(client, timeout_ms) < 0) {
+      return NULL;
+    }
+    msg.msg_controllen = sizeof(control.buffer);
+    n = recvmsg(client->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+      return NULL;
+    }
+  } while (is_ack(reply, (size_t)n));
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  }
+
+  // mbas replies "RING error=..." without fds when it has no ring to give
+  reply[n] = '\0';
+  mbas_ring_writer *ring = NULL;
+  if (fds[0] < 0 || strncmp(reply, "RING slots=", 11) != 0) {
+    errno = EBUSY;
+    goto close_fds;
+  }
+
+  ring = malloc(sizeof(mbas_ring_writer));
+  if (!ring) {
+    goto close_fds;
+  }
+  ring->ring = mmap(NULL, sizeof(struct mbas_ring), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fds[0], 0);
+  if (ring->ring == MAP_FAILED) {
+    free(ring);
+    ring = NULL;
+    goto close_fds;
+  }
+  if (ring->ring->magic != MBAS_RING_MAGIC ||
+      ring->ring->version != MBAS_RING_VERSION ||
+      ring->ring->slots != MBAS_RING_SLOTS) {
+    munmap(ring->ring, sizeof(struct mbas_ring));
+    free(ring);
+    ring = NULL;
+    errno = EPROTO;
+    goto close_fds;
+  }
+
+  close(fds[0]);
+  ring->eventfd = fds[1];
+  return ring;
+
+close_fds:;
+  int saved = errno;
+  for (int i = 0; i < 2; i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  errno = saved;
+  return NULL;
+}
+
+int mbas_ring_post(mbas_ring_writer *ring, const struct mbas_command *command) {
+  struct mbas_ring *r = ring->ring;
+  uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (tail - head >= MBAS_RING_SLOTS) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  r->commands[tail % MBAS_RING_SLOTS] = *command;
+  // Pairs with `command_ring_sleep` in the daemon: either it sees the new
+  // tail, or this sees it asleep.
+  atomic_store(&r->tail, tail + 1);
+  if (atomic_load(&r->sleeping)) {
+    uint64_t one = 1;
+    if (write(ring->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void mbas_ring_close(mbas_client *client, mbas_ring_writer *ring) {
+  if (!ring) {
+    return;
+  }
+  if (client) {
+    mbas_send(client, "UNRING");
+  }
+  munmap(ring->ring, sizeof(struct mbas_ring));
+  close(ring->eventfd);
+  free(ring);
+}
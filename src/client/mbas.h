@@ -0,0 +1,83 @@
+#ifndef MBAS_CLIENT_H
+#define MBAS_CLIENT_H
+
+#include <stddef.h>
+
+#include "../protocol.h"
+
+// Client library for mbas.
+//
+// A client keeps one datagram socket connected to mbas for as long as it
+// lives, so sending a command is a single syscall. Sends never block: when
+// the socket buffer is full they fail with EAGAIN and the command is not
+// sent. Functions that can fail return -1, or NULL, and set errno.
+
+#define MBAS_DEFAULT_SOCKET "/tmp/mbas.sock"
+
+typedef struct mbas_client mbas_client;
+typedef struct mbas_ring_writer mbas_ring_writer;
+
+// A PLAY of the next step at the normal rate and gain, to adjust before
+// sending.
+static inline struct mbas_command mbas_play_command(void) {
+  struct mbas_command c = {
+      .type = MBAS_COMMAND_PLAY,
+      .velocity = MBAS_NO_VELOCITY,
+      .flags = 0,
+      .step = MBAS_NEXT_STEP,
+      .rate = 1.0f,
+      .gain = 1.0f,
+      .seq = 0,
+      .reserved = 0,
+      .at_ns = 0,
+  };
+  return c;
+}
+
+// Connects to the socket at `path`, or MBAS_DEFAULT_SOCKET if NULL. The
+// client socket is bound to an abstract address so mbas can reply to it.
+mbas_client *mbas_connect(const char *path);
+void mbas_disconnect(mbas_client *client);
+
+// Socket of `client`, to poll for POLLOUT after EAGAIN.
+int mbas_fd(const mbas_client *client);
+
+// Sends one binary PLAY.
+int mbas_play(mbas_client *client, const struct mbas_command *command);
+
+// Sends `count` binary PLAYs with as few syscalls as possible. Returns how
+// many were sent, which is less than `count` if the socket buffer filled up.
+int mbas_send_many(mbas_client *client, const struct mbas_command *commands,
+                   size_t count);
+
+// Reads the acks of PLAYs sent with MBAS_FLAG_ACK that arrived, at most
+// `max`. Returns how many were read, 0 if none are waiting.
+int mbas_recv_acks(mbas_client *client, struct mbas_ack *acks, size_t max);
+
+// Sends the text command `text`, e.g. "SELECT chorus".
+int mbas_send(mbas_client *client, const char *text);
+
+// Sends the text command `text` and waits up to `timeout_ms` for the reply,
+// which is stored NUL terminated in `reply`. Returns its length. Binary acks
+// arriving in the meantime are discarded.
+int mbas_request(mbas_client *client, const char *text, char *reply,
+                 size_t size, int timeout_ms);
+
+// Asks mbas for its output latency, see LATENCY, waiting up to `timeout_ms`
+// for it. A PLAY sent now is heard `latency_ns` from now at the earliest, so
+// `mbas_command.at_ns` is best set at least that far ahead.
+int mbas_latency(mbas_client *client, int64_t *latency_ns, int timeout_ms);
+
+// Asks mbas for a command ring, see `mbas_ring` in protocol.h, waiting up to
+// `timeout_ms` for it.
+mbas_ring_writer *mbas_ring_open(mbas_client *client, int timeout_ms);
+
+// Posts `command` to `ring`, waking mbas up if it is not polling the ring.
+// Fails with EAGAIN if the ring is full.
+int mbas_ring_post(mbas_ring_writer *ring, const struct mbas_command *command);
+
+// Unmaps `ring`. With a `client`, also sends UNRING, which closes every ring
+// of this process.
+void mbas_ring_close(mbas_client *client, mbas_ring_writer *ring);
+
+#endif
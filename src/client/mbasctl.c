@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbas.h"
+
+// Command line client for mbas, in place of socat.
+//
+//   mbasctl [-s socket] [-n count] COMMAND [ARG]...
+//
+// Sends COMMAND and its arguments as a text command, and prints the reply
+// of STATUS, LATENCY and PLAY seq=. With -n, a PLAY is sent `count` times, as
+// binary commands in as few syscalls as possible.
+
+#define REPLY_TIMEOUT_MS 1000
+
+static void usage(void) {
+  fprintf(stderr, "Usage: mbasctl [-s socket] [-n count] COMMAND [ARG]...\n");
+}
+
+// Fills `c` from the `key=value` arguments of a PLAY. Step labels only exist
+// in the text command. Returns false if any argument is invalid.
+static bool parse_play(int argc, char **argv, struct mbas_command *c) {
+  for (int i = 0; i < argc; i++) {
+    char *end;
+    if (strncmp(argv[i], "rate=", 5) == 0) {
+      c->rate = strtof(argv[i] + 5, &end);
+    } else if (strncmp(argv[i], "gain=", 5) == 0) {
+      c->gain = strtof(argv[i] + 5, &end);
+    } else if (strncmp(argv[i], "vel=", 4) == 0) {
+      long velocity = strtol(argv[i] + 4, &end, 10);
+      if (velocity < 0 || velocity >= MBAS_NO_VELOCITY) {
+        return false;
+      }
+      c->velocity = (uint8_t)velocity;
+    } else {
+      fprintf(stderr, "Not supported with -n: %s\n", argv[i]);
+      return false;
+    }
+    if (*end != '\0') {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const char *path = NULL;
+  long count = 0;
+
+  int i = 1;
+  for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+    if (strcmp(argv[i], "-s") == 0) {
+      path = argv[i + 1];
+    } else if (strcmp(argv[i], "-n") == 0) {
+      count = strtol(argv[i + 1], NULL, 10);
+    } else {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+  if (i >= argc || count < 0) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  mbas_client *client = mbas_connect(path);
+  if (!client) {
+    perror("mbas_connect");
+    return EXIT_FAILURE;
+  }
+
+  int status = EXIT_FAILURE;
+  if (count > 0) {
+    if (strcmp(argv[i], "PLAY") != 0) {
+      fprintf(stderr, "-n only repeats PLAY\n");
+      goto disconnect;
+    }
+
+    struct mbas_command c = mbas_play_command();
+    if (!parse_play(argc - i - 1, argv + i + 1, &c)) {
+      fprintf(stderr, "Invalid PLAY arguments\n");
+      goto disconnect;
+    }
+    struct mbas_command *commands = malloc(count * sizeof(c));
+    if (!commands) {
+      fprintf(stderr, "Failed to allocate %ld commands\n", count);
+      goto disconnect;
+    }
+    for (long j = 0; j < count; j++) {
+      commands[j] = c;
+    }
+
+    // Waits for room in the socket buffer whenever it fills up
+    long sent = 0;
+    while (sent < count) {
+      int n = mbas_send_many(client, commands + sent, (size_t)(count - sent));
+      if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("mbas_send_many");
+        break;
+      }
+      sent += n > 0 ? n : 0;
+      struct pollfd pfd = {.fd = mbas_fd(client), .events = POLLOUT};
+      if (sent < count && poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0) {
+        fprintf(stderr, "Timed out, sent %ld of %ld\n", sent, count);
+        break;
+      }
+    }
+    free(commands);
+    if (sent == count) {
+      status = EXIT_SUCCESS;
+    }
+    goto disconnect;
+  }
+
+  char text[256] = "";
+  size_t len = 0;
+  for (int j = i; j < argc; j++) {
+    int n = snprintf(text + len, sizeof(text) - len, "%s%s",
+                     j > i ? " " : "", argv[j]);
+    if (n < 0 || (size_t)n >= sizeof(text) - len) {
+      fprintf(stderr, "Command too long\n");
+      goto disconnect;
+    }
+    len += (size_t)n;
+  }
+
+  // STATUS, LATENCY and PLAY seq= get a reply
+  bool reply_expected =
+      strcmp(argv[i], "STATUS") == 0 || strcmp(argv[i], "LATENCY") == 0;
+  for (int j = i + 1; j < argc && strcmp(argv[i], "PLAY") == 0; j++) {
+    reply_expected |= strncmp(argv[j], "seq=", 4) == 0;
+  }
+
+  if (reply_expected) {
+    char reply[256];
+    if (mbas_request(client, text, reply, sizeof(reply), REPLY_TIMEOUT_MS) <
+        0) {
+      perror(argv[i]);
+      goto disconnect;
+    }
+    fputs(reply, stdout);
+  } else if (mbas_send(client, text) < 0) {
+    perror(argv[i]);
+    goto disconnect;
+  }
+  status = EXIT_SUCCESS;
+
+disconnect:
+  mbas_disconnect(client);
+  return status;
+}
@@ -7,12 +7,70 @@
 #include <string.h>
 
 const char *const CONFIG_FILE_PATH = "~/.config/mbas/config.toml";
+const char *const DEFAULT_CACHE_DIR = "~/.cache/mbas";
 
 enum Mode { MODE_SINGLE_SAMPLE = 0 };
 enum Backend { BACKEND_PIPEWIRE = 0 };
+enum Interpolation {
+  INTERP_LINEAR = 0,
+  INTERP_CUBIC = 1,
+  INTERP_SINC = 2,
+};
+enum OrderMode {
+  ORDER_LINEAR = 0,
+  ORDER_SHUFFLE = 1,
+  ORDER_PINGPONG = 2,
+  ORDER_WEIGHTED = 3,
+};
+enum SampleEncoding {
+  ENCODING_F32 = 0,
+  ENCODING_S16 = 1,
+  ENCODING_ADPCM = 2,
+};
+enum Overflow {
+  OVERFLOW_DROP_NEWEST = 0,
+  OVERFLOW_DROP_OLDEST = 1,
+  OVERFLOW_COALESCE = 2,
+};
+enum IdleRelease {
+  IDLE_RELEASE_COLD = 0,
+  IDLE_RELEASE_PAGEOUT = 1,
+};
 
 typedef enum Mode Mode;
 typedef enum Backend Backend;
+typedef enum Overflow Overflow;
+typedef enum Interpolation Interpolation;
+typedef enum OrderMode OrderMode;
+typedef enum SampleEncoding SampleEncoding;
+typedef enum IdleRelease IdleRelease;
+
+const int64_t DEFAULT_QUEUE_DEPTH = 1;
+const int64_t MAX_QUEUE_DEPTH = 4096;
+const int64_t DEFAULT_CROSSFADE_MS = 5;
+const double DEFAULT_STRETCH_SMOOTHING = 0.25;
+const double DEFAULT_STRETCH_MAX_RATIO = 4.0;
+const char *const DEFAULT_OSC_ADDRESS = "127.0.0.1";
+
+// Playback rates, from the step sequence file or `PLAY rate=`
+#define MIN_PLAYBACK_RATE 0.0625
+#define MAX_PLAYBACK_RATE 4.0
+
+// `PLAY vel=` takes MIDI-like velocities
+#define MAX_VELOCITY 127
+#define MAX_GAIN 4.0
+
+// How far past the latency `PLAY at=` may be, since a PLAY waiting for its
+// time holds the queue and keeps the stream running
+#define MAX_AT_AHEAD_NS (10 * (int64_t)1000000000)
+
+// A named step sequence, from `[[sequence]]` or `single_sample.step_seq_path`
+struct SequenceConfig {
+  char *name;
+  char *step_seq_path;
+};
+
+typedef struct SequenceConfig SequenceConfig;
 
 struct Config {
   Mode mode;
@@ -21,9 +79,86 @@ struct Config {
   union {
     struct {
       char *sample_path;
-      char *step_seq_path;
+      // Keep only the parts of the sample used by some step
+      bool trim;
+      // How the sample is kept in memory
+      SampleEncoding encoding;
     } single_sample;
   } options;
+
+  struct {
+    // Empty disables the cache
+    char *dir;
+    // Share the prepared sample between instances through /dev/shm
+    bool shared;
+  } cache;
+
+  struct {
+    // Back the sample with 2 MB pages
+    bool huge_pages;
+  } memory;
+
+  struct {
+    // Load the sample and connect to PipeWire on the first command
+    bool lazy;
+  } startup;
+
+  struct {
+    // Seconds without playing before releasing the sample and the stream, 0
+    // never releases them
+    uint32_t timeout_s;
+    IdleRelease release;
+  } idle;
+
+  struct {
+    // File the playback position is kept in across restarts, empty disables
+    // it
+    char *path;
+  } state;
+
+  SequenceConfig *sequences;
+  size_t sequence_count;
+
+  struct {
+    Interpolation interpolation;
+  } playback;
+
+  struct {
+    OrderMode mode;
+    // 0 picks one at startup
+    uint64_t seed;
+  } order;
+
+  struct {
+    // Gain for each velocity
+    float curve[MAX_VELOCITY + 1];
+  } velocity;
+
+  struct {
+    uint32_t depth;
+    Overflow overflow;
+  } queue;
+
+  struct {
+    // 0 disables catch-up
+    uint32_t threshold;
+    uint32_t crossfade_ms;
+  } catch_up;
+
+  struct {
+    bool enabled;
+    // Weight of the newest inter-arrival time in the running average
+    double smoothing;
+    // Steps are stretched at most this much, and shrunk at most 1 / this
+    double max_ratio;
+  } time_stretch;
+
+  struct {
+    // UDP port OSC messages are received on, 0 disables them
+    uint16_t port;
+    // IPv4 address the port is bound to
+    char *address;
+  } osc;
 };
 
 typedef struct Config Config;
@@ -43,7 +178,7 @@ enum {
 };
 
 char *expand_path(char *path) {
-  char *new_path;
+  char *new_path = path;
   if (path[0] == '~') {
     const char *home = getenv("HOME");
     size_t path_len = strlen(path);
@@ -75,10 +210,135 @@ toml_datum_t toml_seek_typed(toml_datum_t root, const char *option_name,
   return datum;
 }
 
+// Like toml_seek_typed, but a missing option is not an error.
+// The caller checks `datum.type == exp_type` to know if it was set.
+toml_datum_t toml_seek_optional(toml_datum_t root, const char *option_name,
+                                toml_type_t exp_type,
+                                load_config_result_t *ret) {
+  toml_datum_t datum = toml_seek(root, option_name);
+
+  if (datum.type == TOML_UNKNOWN) {
+    return datum;
+  }
+
+  return toml_seek_typed(root, option_name, exp_type, ret);
+}
+
+static bool toml_number(toml_datum_t datum, double *value) {
+  if (datum.type == TOML_INT64) {
+    *value = (double)datum.u.int64;
+    return true;
+  }
+  if (datum.type == TOML_FP64) {
+    *value = datum.u.fp64;
+    return true;
+  }
+  return false;
+}
+
+// Fills `curve` from `[[velocity, gain], ...]` points, sorted by velocity,
+// interpolating linearly between them.
+bool parse_velocity_curve(toml_datum_t points, float *curve) {
+  int32_t size = points.u.arr.size;
+  double prev_velocity = -1.0;
+  double prev_gain = 0.0;
+
+  if (size == 0) {
+    return false;
+  }
+
+  for (int32_t i = 0; i < size; i++) {
+    toml_datum_t point = points.u.arr.elem[i];
+    double velocity, gain;
+    if (point.type != TOML_ARRAY || point.u.arr.size != 2 ||
+        !toml_number(point.u.arr.elem[0], &velocity) ||
+        !toml_number(point.u.arr.elem[1], &gain)) {
+      return false;
+    }
+    if (velocity <= prev_velocity || velocity > MAX_VELOCITY || gain < 0.0 ||
+        gain > MAX_GAIN) {
+      return false;
+    }
+
+    int from = prev_velocity < 0.0 ? 0 : (int)prev_velocity + 1;
+    for (int v = from; v <= (int)velocity; v++) {
+      if (prev_velocity < 0.0) {
+        curve[v] = (float)gain;
+      } else {
+        double t = (v - prev_velocity) / (velocity - prev_velocity);
+        curve[v] = (float)(prev_gain + t * (gain - prev_gain));
+      }
+    }
+
+    prev_velocity = velocity;
+    prev_gain = gain;
+  }
+
+  for (int v = (int)prev_velocity + 1; v <= MAX_VELOCITY; v++) {
+    curve[v] = (float)prev_gain;
+  }
+  return true;
+}
+
+// Appends a sequence to `config->sequences`. Names must be unique.
+bool add_sequence(Config *config, const char *name, const char *step_seq_path,
+                  load_config_result_t *ret) {
+  for (size_t i = 0; i < config->sequence_count; i++) {
+    if (strcmp(config->sequences[i].name, name) == 0) {
+      ret->code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+      size_t buf_size = 128;
+      ret->errmsg = (char *)malloc(buf_size);
+      snprintf(ret->errmsg, buf_size,
+               "Error: sequence '%s' is defined more than once.", name);
+      return false;
+    }
+  }
+
+  SequenceConfig *sequences = (SequenceConfig *)realloc(
+      config->sequences, (config->sequence_count + 1) * sizeof(SequenceConfig));
+  if (!sequences) {
+    ret->code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+    ret->errmsg = strdup("Error: out of memory reading sequences.");
+    return false;
+  }
+
+  config->sequences = sequences;
+  config->sequences[config->sequence_count].name = strdup(name);
+  config->sequences[config->sequence_count].step_seq_path =
+      expand_path(strdup(step_seq_path));
+  config->sequence_count++;
+  return true;
+}
+
 load_config_result_t load_config_file(Config *config, const char *path) {
   load_config_result_t ret = {0};
   ret.code = LOAD_CONFIG_SUCCESS;
 
+  config->sequences = NULL;
+  config->sequence_count = 0;
+  config->cache.dir = NULL;
+  config->cache.shared = false;
+  config->memory.huge_pages = false;
+  config->startup.lazy = false;
+  config->idle.timeout_s = 0;
+  config->idle.release = IDLE_RELEASE_COLD;
+  config->state.path = NULL;
+  config->playback.interpolation = INTERP_CUBIC;
+  config->order.mode = ORDER_LINEAR;
+  config->order.seed = 0;
+  for (int v = 0; v <= MAX_VELOCITY; v++) {
+    config->velocity.curve[v] = (float)v / MAX_VELOCITY;
+  }
+  config->queue.depth = DEFAULT_QUEUE_DEPTH;
+  config->queue.overflow = OVERFLOW_DROP_NEWEST;
+  config->catch_up.threshold = 0;
+  config->catch_up.crossfade_ms = DEFAULT_CROSSFADE_MS;
+  config->time_stretch.enabled = false;
+  config->time_stretch.smoothing = DEFAULT_STRETCH_SMOOTHING;
+  config->time_stretch.max_ratio = DEFAULT_STRETCH_MAX_RATIO;
+  config->osc.port = 0;
+  config->osc.address = NULL;
+
   FILE *file = fopen(path, "r");
 
   if (!file) {
@@ -131,8 +391,12 @@ load_config_result_t load_config_file(Config *config, const char *path) {
   case MODE_SINGLE_SAMPLE: {
     toml_datum_t sample_path = toml_seek_typed(
         result.toptab, "single_sample.sample_path", TOML_STRING, &ret);
-    toml_datum_t step_seq_path = toml_seek_typed(
+    toml_datum_t step_seq_path = toml_seek_optional(
         result.toptab, "single_sample.step_seq_path", TOML_STRING, &ret);
+    toml_datum_t trim = toml_seek_optional(
+        result.toptab, "single_sample.trim", TOML_BOOLEAN, &ret);
+    toml_datum_t encoding = toml_seek_optional(
+        result.toptab, "single_sample.encoding", TOML_STRING, &ret);
 
     if (ret.code != LOAD_CONFIG_SUCCESS) {
       goto end;
@@ -141,13 +405,353 @@ load_config_result_t load_config_file(Config *config, const char *path) {
     config->options.single_sample.sample_path = strdup(sample_path.u.s);
     config->options.single_sample.sample_path =
         expand_path(config->options.single_sample.sample_path);
-    config->options.single_sample.step_seq_path = strdup(step_seq_path.u.s);
-    config->options.single_sample.step_seq_path =
-        expand_path(config->options.single_sample.step_seq_path);
+    config->options.single_sample.trim =
+        trim.type == TOML_BOOLEAN && trim.u.boolean;
+    config->options.single_sample.encoding = ENCODING_F32;
+
+    if (encoding.type == TOML_STRING) {
+      if (strcmp(encoding.u.s, "f32") == 0) {
+        config->options.single_sample.encoding = ENCODING_F32;
+      } else if (strcmp(encoding.u.s, "s16") == 0) {
+        config->options.single_sample.encoding = ENCODING_S16;
+      } else if (strcmp(encoding.u.s, "adpcm") == 0) {
+        config->options.single_sample.encoding = ENCODING_ADPCM;
+      } else {
+        ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+        ret.errmsg = strdup("Error: unsupported 'single_sample.encoding' in "
+                            "config file. Supported values: \"f32\", "
+                            "\"s16\", \"adpcm\".");
+        goto end;
+      }
+    }
+
+    if (step_seq_path.type == TOML_STRING &&
+        !add_sequence(config, "default", step_seq_path.u.s, &ret)) {
+      goto end;
+    }
     break;
   }
   }
 
+  // Sequence banks
+  toml_datum_t sequences =
+      toml_seek_optional(result.toptab, "sequence", TOML_ARRAY, &ret);
+
+  if (ret.code != LOAD_CONFIG_SUCCESS) {
+    goto end;
+  }
+
+  if (sequences.type == TOML_ARRAY) {
+    for (int32_t i = 0; i < sequences.u.arr.size; i++) {
+      toml_datum_t sequence = sequences.u.arr.elem[i];
+      toml_datum_t name = toml_get(sequence, "name");
+      toml_datum_t path = toml_get(sequence, "step_seq_path");
+
+      if (sequence.type != TOML_TABLE || name.type != TOML_STRING ||
+          path.type != TOML_STRING) {
+        ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+        ret.errmsg = strdup("Error: every [[sequence]] needs a 'name' and a "
+                            "'step_seq_path' string.");
+        goto end;
+      }
+
+      if (!add_sequence(config, name.u.s, path.u.s, &ret)) {
+        goto end;
+      }
+    }
+  }
+
+  if (config->sequence_count == 0) {
+    ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+    ret.errmsg = strdup("Error: no step sequence in config file. Set "
+                        "'single_sample.step_seq_path' or add a [[sequence]].");
+    goto end;
+  }
+
+  // Playback
+  toml_datum_t interpolation = toml_seek_optional(
+      result.toptab, "playback.interpolation", TOML_STRING, &ret);
+
+  if (ret.code != LOAD_CONFIG_SUCCESS) {
+    goto end;
+  }
+
+  if (interpolation.type == TOML_STRING) {
+    if (strcmp(interpolation.u.s, "linear") == 0) {
+      config->playback.interpolation = INTERP_LINEAR;
+    } else if (strcmp(interpolation.u.s, "cubic") == 0) {
+      config->playback.interpolation = INTERP_CUBIC;
+    } else if (strcmp(interpolation.u.s, "sinc") == 0) {
+      config->playback.interpolation = INTERP_SINC;
+    } else {
+      ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+      ret.errmsg = strdup("Error: unsupported 'playback.interpolation' in "
+                          "config file. Supported values: \"linear\", "
+                          "\"cubic\", \"sinc\".");
+      goto end;
+    }
+  }
+
+  // Cache
+  toml_datum_t cache_dir =
+      toml_seek_optional(result.toptab, "cache.dir", TOML_STRING, &ret);
+  toml_datum_t cache_shared =
+      toml_seek_optional(result.toptab, "cache.shared", TOML_BOOLEAN, &ret);
+
+  if (ret.code != LOAD_CONFIG_SUCCESS) {
+    goto end;
+  }
+
+  config->cache.dir = expand_path(strdup(
+      cache_dir.type == TOML_STRING ? cache_dir.u.s : DEFAULT_CACHE_DIR));
+  config->cache.shared =
+      cache_shared.type == TOML_BOOLEAN && cache_shared.u.boolean;
+
+  // Memory
+  toml_datum_t huge_pages = toml_seek_optional(
+      result.toptab, "memory.huge_pages", TOML_BOOLEAN, &ret);
+
+  if (ret.code != LOAD_CONFIG_SUCCESS) {
+    goto end;
+  }
+
+  config->memory.huge_pages =
+      huge_pages.type == TOML_BOOLEAN && huge_pages.u.boolean;
+
+  // Startup
+  toml_datum_t lazy =
+      toml_seek_optional(result.toptab, "startup.lazy", TOML_BOOLEAN, &ret);
+
+  if (ret.code != LOAD_CONFIG_SUCCESS) {
+    goto end;
+  }
+
+  config->startup.lazy = lazy.type == TOML_BOOLEAN && lazy.u.boolean;
+
+  // Idle
+  toml_datum_t idle_timeout =
+      toml_seek_optional(result.toptab, "idle.timeout_s", TOML_INT64, &ret);
+  toml_datum_t idle_release =
+      toml_seek_optional(result.toptab, "idle.release", TOML_STRING, &ret);
+
+  if (ret.code != LOAD_CONFIG_SUCCESS) {
+    goto end;
+  }
+
+  if (idle_timeout.type == TOML_INT64) {
+    if (idle_timeout.u.int64 < 0 || idle_timeout.u.int64 > UINT32_MAX) {
+      ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+      ret.errmsg = strdup("Error: 'idle.timeout_s' must not be negative.");
+      goto end;
+    }
+    config->idle.timeout_s = (uint32_t)idle_timeout.u.int64;
+  }
+
+  if (idle_release.type == TOML_STRING) {
+    if (strcmp(idle_release.u.s, "cold") == 0) {
+      config->idle.release = IDLE_RELEASE_COLD;
+    } else if (strcmp(idle_release.u.s, "pageout") == 0) {
+      config->idle.release = IDLE_RELEASE_PAGEOUT;
+    } else {
+      ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+      ret.errmsg = strdup("Error: unsupported 'idle.release' in config file. "
+                          "Supported values: \"cold\", \"pageout\".");
+      goto end;
+    }
+  }
+
+  // Persistent state
+  toml_datum_t state_path =
+      toml_seek_optional(result.toptab, "state.path", TOML_STRING, &ret);
+
+  if (ret.code != LOAD_CONFIG_SUCCESS) {
+    goto end;
+  }
+
+  config->state.path = expand_path(
+      strdup(state_path.type == TOML_STRING ? state_path.u.s : ""));
+
+  // Order
+  toml_datum_t order_mode =
+      toml_seek_optional(result.toptab, "order.mode", TOML_STRING, &ret);
+  toml_datum_t order_seed =
+      toml_seek_optional(result.toptab, "order.seed", TOML_INT64, &ret);
+
+  if (ret.code != LOAD_CONFIG_SUCCESS) {
+    goto end;
+  }
+
+  if (order_mode.type == TOML_STRING) {
+    if (strcmp(order_mode.u.s, "linear") == 0) {
+      config->order.mode = ORDER_LINEAR;
+    } else if (strcmp(order_mode.u.s, "shuffle") == 0) {
+      config->order.mode = ORDER_SHUFFLE;
+    } else if (strcmp(order_mode.u.s, "pingpong") == 0) {
+      config->order.mode = ORDER_PINGPONG;
+    } else if (strcmp(order_mode.u.s, "weighted") == 0) {
+      config->order.mode = ORDER_WEIGHTED;
+    } else {
+      ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+      ret.errmsg = strdup("Error: unsupported 'order.mode' in config file. "
+                          "Supported values: \"linear\", \"shuffle\", "
+                          "\"pingpong\", \"weighted\".");
+      goto end;
+    }
+  }
+
+  if (order_seed.type == TOML_INT64) {
+    config->order.seed = (uint64_t)order_seed.u.int64;
+  }
+
+  // Velocity
+  toml_datum_t velocity_curve = toml_seek_optional(
+      result.toptab, "velocity.curve", TOML_ARRAY, &ret);
+
+  if (ret.code != LOAD_CONFIG_SUCCESS) {
+    goto end;
+  }
+
+  if (velocity_curve.type == TOML_ARRAY &&
+      !parse_velocity_curve(velocity_curve, config->velocity.curve)) {
+    ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+    ret.errmsg = strdup("Error: 'velocity.curve' must be a list of [velocity, "
+                        "gain] points sorted by velocity, with velocities in "
+                        "[0, 127] and gains in [0, 4].");
+    goto end;
+  }
+
+  // Trigger queue
+  toml_datum_t queue_depth =
+      toml_seek_optional(result.toptab, "queue.depth", TOML_INT64, &ret);
+  toml_datum_t queue_overflow =
+      toml_seek_optional(result.toptab, "queue.overflow", TOML_STRING, &ret);
+
+  if (ret.code != LOAD_CONFIG_SUCCESS) {
+    goto end;
+  }
+
+  if (queue_depth.type == TOML_INT64) {
+    if (queue_depth.u.int64 < 1 || queue_depth.u.int64 > MAX_QUEUE_DEPTH) {
+      ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+      ret.errmsg = strdup("Error: 'queue.depth' must be between 1 and 4096.");
+      goto end;
+    }
+    config->queue.depth = (uint32_t)queue_depth.u.int64;
+  }
+
+  if (queue_overflow.type == TOML_STRING) {
+    if (strcmp(queue_overflow.u.s, "drop_newest") == 0) {
+      config->queue.overflow = OVERFLOW_DROP_NEWEST;
+    } else if (strcmp(queue_overflow.u.s, "drop_oldest") == 0) {
+      config->queue.overflow = OVERFLOW_DROP_OLDEST;
+    } else if (strcmp(queue_overflow.u.s, "coalesce") == 0) {
+      config->queue.overflow = OVERFLOW_COALESCE;
+    } else {
+      ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+      ret.errmsg = strdup("Error: unsupported 'queue.overflow' in config "
+                          "file. Supported values: \"drop_newest\", "
+                          "\"drop_oldest\", \"coalesce\".");
+      goto end;
+    }
+  }
+
+  // Catch-up
+  toml_datum_t catch_up_threshold = toml_seek_optional(
+      result.toptab, "catch_up.threshold", TOML_INT64, &ret);
+  toml_datum_t catch_up_crossfade = toml_seek_optional(
+      result.toptab, "catch_up.crossfade_ms", TOML_INT64, &ret);
+
+  if (ret.code != LOAD_CONFIG_SUCCESS) {
+    goto end;
+  }
+
+  if (catch_up_threshold.type == TOML_INT64) {
+    if (catch_up_threshold.u.int64 < 0 ||
+        catch_up_threshold.u.int64 > MAX_QUEUE_DEPTH) {
+      ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+      ret.errmsg =
+          strdup("Error: 'catch_up.threshold' must be between 0 and 4096.");
+      goto end;
+    }
+    // Only `queue.depth` PLAYs can wait, so a higher threshold is never hit
+    if (catch_up_threshold.u.int64 > 0 &&
+        catch_up_threshold.u.int64 >= config->queue.depth) {
+      ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+      ret.errmsg =
+          strdup("Error: 'catch_up.threshold' must be below 'queue.depth'.");
+      goto end;
+    }
+    config->catch_up.threshold = (uint32_t)catch_up_threshold.u.int64;
+  }
+
+  if (catch_up_crossfade.type == TOML_INT64) {
+    if (catch_up_crossfade.u.int64 < 0 || catch_up_crossfade.u.int64 > 1000) {
+      ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+      ret.errmsg =
+          strdup("Error: 'catch_up.crossfade_ms' must be between 0 and 1000.");
+      goto end;
+    }
+    config->catch_up.crossfade_ms = (uint32_t)catch_up_crossfade.u.int64;
+  }
+
+  // Time-stretch
+  toml_datum_t stretch_enabled = toml_seek_optional(
+      result.toptab, "time_stretch.enabled", TOML_BOOLEAN, &ret);
+  toml_datum_t stretch_smoothing = toml_seek_optional(
+      result.toptab, "time_stretch.smoothing", TOML_FP64, &ret);
+  toml_datum_t stretch_max_ratio = toml_seek_optional(
+      result.toptab, "time_stretch.max_ratio", TOML_FP64, &ret);
+
+  if (ret.code != LOAD_CONFIG_SUCCESS) {
+    goto end;
+  }
+
+  if (stretch_enabled.type == TOML_BOOLEAN) {
+    config->time_stretch.enabled = stretch_enabled.u.boolean;
+  }
+
+  if (stretch_smoothing.type == TOML_FP64) {
+    if (stretch_smoothing.u.fp64 <= 0.0 || stretch_smoothing.u.fp64 > 1.0) {
+      ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+      ret.errmsg = strdup(
+          "Error: 'time_stretch.smoothing' must be in the range (0, 1].");
+      goto end;
+    }
+    config->time_stretch.smoothing = stretch_smoothing.u.fp64;
+  }
+
+  if (stretch_max_ratio.type == TOML_FP64) {
+    if (stretch_max_ratio.u.fp64 < 1.0 || stretch_max_ratio.u.fp64 > 16.0) {
+      ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+      ret.errmsg = strdup(
+          "Error: 'time_stretch.max_ratio' must be between 1.0 and 16.0.");
+      goto end;
+    }
+    config->time_stretch.max_ratio = stretch_max_ratio.u.fp64;
+  }
+
+  // OSC
+  toml_datum_t osc_port =
+      toml_seek_optional(result.toptab, "osc.port", TOML_INT64, &ret);
+  toml_datum_t osc_address =
+      toml_seek_optional(result.toptab, "osc.address", TOML_STRING, &ret);
+
+  if (ret.code != LOAD_CONFIG_SUCCESS) {
+    goto end;
+  }
+
+  if (osc_port.type == TOML_INT64) {
+    if (osc_port.u.int64 < 0 || osc_port.u.int64 > UINT16_MAX) {
+      ret.code = LOAD_CONFIG_INVALID_OPTION_VALUE;
+      ret.errmsg = strdup("Error: 'osc.port' must be between 0 and 65535.");
+      goto end;
+    }
+    config->osc.port = (uint16_t)osc_port.u.int64;
+  }
+
+  config->osc.address = strdup(
+      osc_address.type == TOML_STRING ? osc_address.u.s : DEFAULT_OSC_ADDRESS);
+
 end:
   toml_free(result);
   return ret;
@@ -165,9 +769,17 @@ void free_config(Config *config) {
   switch (config->mode) {
   case MODE_SINGLE_SAMPLE:
     free(config->options.single_sample.sample_path);
-    free(config->options.single_sample.step_seq_path);
     break;
   }
+
+  for (size_t i = 0; i < config->sequence_count; i++) {
+    free(config->sequences[i].name);
+    free(config->sequences[i].step_seq_path);
+  }
+  free(config->sequences);
+  free(config->cache.dir);
+  free(config->state.path);
+  free(config->osc.address);
 }
 
 #endif
@@ -1,123 +1,1205 @@
+#ifndef MBAS_DATA_C
+#define MBAS_DATA_C
+
+#include <fcntl.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.c"
 #include "config.c"
+#include "decode.c"
+#include "encoding.c"
+#include "labels.c"
+#include "wav.c"
+
+// Steps [first, first + length) of Data, with their own label table
+struct Sequence {
+  char *name;
+  size_t first;
+  size_t length;
+  label_table labels;
+};
+
+typedef struct Sequence Sequence;
 
 struct Data {
+  // NULL when the sample is kept in `sample_encoded`, see `sample_decode`
   float *sample;
   size_t sample_length;
+  // Mapping holding `sample`, `sample_mapped` bytes long. NULL if `sample`
+  // was allocated.
+  void *sample_map;
+  size_t sample_mapped;
+  // File behind `sample_map`, holding the image `sample_offset` bytes in, to
+  // hand it over on an upgrade. -1 if the mapping is anonymous. Only set
+  // along with `sample_map`.
+  int sample_fd;
+  off_t sample_offset;
+  SampleEncoding sample_encoding;
+  void *sample_encoded;
+  // Frames of the sample file, which the steps index before trimming
+  size_t source_length;
+  // Identifies the image of the sample, see `shared_sample_key`. 0 if unknown.
+  uint64_t image_key;
 
   size_t *step_sequence_l;
   size_t *step_sequence_r;
+  float *step_sequence_rate;
+  // Relative odds of each step with the "weighted" order
+  float *step_sequence_weight;
   size_t step_sequence_length;
-};
 
-typedef struct Data Data;
+  // Optional step labels, NULL for unlabeled steps. Strings live in
+  // `label_pool`.
+  char **step_sequence_label;
+  // Text of the `next=` option of each step, NULL when it has none, see
+  // `parse_transitions`. Also in `label_pool`.
+  char **step_sequence_next;
+  char *label_pool;
+  size_t label_pool_used;
 
-Data data_from_config_wav(const Config *config) {
-  Data data = {0};
+  Sequence *sequences;
+  size_t sequence_count;
 
-  const char *sample_path = config->options.single_sample.sample_path;
-  const char *step_seq_path = config->options.single_sample.step_seq_path;
+  // Single allocation holding the sequences, the step arrays and the pool
+  void *arena;
+};
 
-  // Load sample file
-  // Expected to be raw f32le mono
-  FILE *sample_file = fopen(sample_path, "rb");
+typedef struct Data Data;
 
-  if (!sample_file) {
-    fprintf(stderr, "Failed to open sample file: %s\n", sample_path);
-    goto exit_failure;
+// Copies `token` into the label pool
+static char *pool_string(Data *data, const char *token) {
+  size_t len = strlen(token);
+  char *copy = data->label_pool + data->label_pool_used;
+  memcpy(copy, token, len + 1);
+  data->label_pool_used += len + 1;
+  return copy;
+}
+
+// Parses the `key=value` options and the label after the sample indices of a
+// step. Returns false if any of them is invalid. `next=` is only checked once
+// every label of the sequence is known, see `parse_transitions`.
+bool parse_step_options(char *options, Data *data, size_t index) {
+  char *saveptr = NULL;
+  for (char *token = strtok_r(options, " \t\r\n", &saveptr); token;
+       token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+    if (strncmp(token, "rate=", 5) == 0) {
+      char *end;
+      double rate = strtod(token + 5, &end);
+      if (*end != '\0' || !(rate >= MIN_PLAYBACK_RATE) ||
+          !(rate <= MAX_PLAYBACK_RATE)) {
+        return false;
+      }
+      data->step_sequence_rate[index] = (float)rate;
+    } else if (strncmp(token, "weight=", 7) == 0) {
+      char *end;
+      double weight = strtod(token + 7, &end);
+      if (*end != '\0' || !(weight >= 0.0) || !isfinite(weight)) {
+        return false;
+      }
+      data->step_sequence_weight[index] = (float)weight;
+    } else if (strncmp(token, "next=", 5) == 0) {
+      if (data->step_sequence_next[index]) {
+        return false;
+      }
+      data->step_sequence_next[index] = pool_string(data, token + 5);
+    } else if (strchr(token, '=') == NULL) {
+      if (data->step_sequence_label[index]) {
+        return false;
+      }
+      data->step_sequence_label[index] = pool_string(data, token);
+    } else {
+      return false;
+    }
   }
+  return true;
+}
 
-  fseek(sample_file, 0, SEEK_END);
-  size_t sample_size = ftell(sample_file);
-  rewind(sample_file);
+// Called for each transition of a `next=` option, with the step it leads to,
+// relative to the sequence
+typedef void (*transition_fn)(void *userdata, uint32_t step, double weight);
 
-  data.sample_length = sample_size / sizeof(float);
-  data.sample = (float *)malloc(sample_size);
+// Reads the `next=` option `spec` of a step of `sequence`: comma separated
+// labels of the steps that may follow it with the "weighted" order, each
+// optionally followed by `:<weight>`, e.g. `next=chorus:3,verse`. Calls `add`
+// for each of them if it is not NULL. Returns false if a label is unknown or
+// a weight is not positive.
+bool parse_transitions(const Data *data, const Sequence *sequence,
+                       const char *spec, transition_fn add, void *userdata) {
+  char item[256];
+  for (const char *p = spec; *p != '\0';) {
+    size_t len = strcspn(p, ",");
+    if (len == 0 || len >= sizeof(item)) {
+      return false;
+    }
+    memcpy(item, p, len);
+    item[len] = '\0';
+    p += len + (p[len] == ',');
 
-  size_t res =
-      fread(data.sample, sizeof(float), data.sample_length, sample_file);
-  if (res != data.sample_length) {
-    fprintf(stderr, "Failed to read sample data from file: %s\n", sample_path);
-    goto close_sample_file;
+    double weight = 1.0;
+    char *colon = strrchr(item, ':');
+    if (colon) {
+      char *end;
+      *colon = '\0';
+      weight = strtod(colon + 1, &end);
+      if (*end != '\0' || !(weight > 0.0) || !isfinite(weight)) {
+        return false;
+      }
+    }
+
+    size_t step = label_table_find(
+        &sequence->labels, data->step_sequence_label + sequence->first, item);
+    if (step == SIZE_MAX) {
+      return false;
+    }
+    if (add) {
+      add(userdata, (uint32_t)step, weight);
+    }
   }
+  return true;
+}
 
-  fclose(sample_file);
+static bool is_step_line(const char *line) {
+  // Skip empty lines and comments
+  return !(line[0] == '\n' || line[0] == '#' || line[0] == '\r');
+}
 
-  // Load step sequence file
+// Counts the amount of lines that are not empty or comments. Also bounds the
+// space taken by labels with the size of those lines.
+bool count_steps(const char *step_seq_path, size_t *steps,
+                 size_t *label_bytes) {
   FILE *step_seq_file = fopen(step_seq_path, "r");
 
   if (!step_seq_file) {
     fprintf(stderr, "Failed to open step sequence file: %s\n", step_seq_path);
-    goto free_sample;
+    return false;
   }
 
-  // First, count the number of steps
-  // Count the amount of lines that are not empty or comments
-  data.step_sequence_length = 0;
+  *steps = 0;
+  *label_bytes = 0;
   char line[256];
   while (fgets(line, sizeof(line), step_seq_file)) {
-    // Skip empty lines and comments
-    if (line[0] == '\n' || line[0] == '#' || line[0] == '\r') {
-      continue;
+    if (is_step_line(line)) {
+      (*steps)++;
+      *label_bytes += strlen(line) + 1;
     }
-    data.step_sequence_length++;
   }
-  rewind(step_seq_file);
-  data.step_sequence_l =
-      (size_t *)malloc(data.step_sequence_length * sizeof(size_t));
-  data.step_sequence_r =
-      (size_t *)malloc(data.step_sequence_length * sizeof(size_t));
+  fclose(step_seq_file);
+
+  if (*steps == 0) {
+    fprintf(stderr, "Step sequence file has no steps: %s\n", step_seq_path);
+    return false;
+  }
+  return true;
+}
+
+// Parses the steps of `sequence` into `data`, starting at `sequence->first`.
+bool parse_steps(const char *step_seq_path, Data *data, Sequence *sequence) {
+  FILE *step_seq_file = fopen(step_seq_path, "r");
+
+  if (!step_seq_file) {
+    fprintf(stderr, "Failed to open step sequence file: %s\n", step_seq_path);
+    return false;
+  }
+
+  char line[256];
   size_t real_index = 0;
-  size_t index = 0;
-  while (fgets(line, sizeof(line), step_seq_file)) {
+  size_t index = sequence->first;
+  while (index < sequence->first + sequence->length &&
+         fgets(line, sizeof(line), step_seq_file)) {
     real_index++;
-    // Skip empty lines and comments
-    if (line[0] == '\n' || line[0] == '#' || line[0] == '\r') {
+    if (!is_step_line(line)) {
       continue;
     }
 
     size_t step_l = 0;
     size_t step_r = 0;
+    int consumed = 0;
 
-    int scanned = sscanf(line, "%zu %zu", &step_l, &step_r);
+    int scanned = sscanf(line, "%zu %zu%n", &step_l, &step_r, &consumed);
 
     if (scanned != 2) {
       fprintf(stderr, "Invalid step sequence format in file: %s at line %zu\n",
               step_seq_path, real_index);
-      goto free_step_sequence;
+      goto close_step_seq_file;
     }
 
-    if (step_l > step_r || step_r > data.sample_length) {
+    if (step_l > step_r || step_r > data->sample_length) {
       fprintf(stderr, "Invalid step sequence values in file: %s at line %zu\n",
               step_seq_path, real_index);
-      goto free_step_sequence;
+      goto close_step_seq_file;
+    }
+
+    data->step_sequence_l[index] = step_l;
+    data->step_sequence_r[index] = step_r;
+    data->step_sequence_rate[index] = 1.0f;
+    data->step_sequence_weight[index] = 1.0f;
+    data->step_sequence_label[index] = NULL;
+    data->step_sequence_next[index] = NULL;
+
+    if (!parse_step_options(line + consumed, data, index)) {
+      fprintf(stderr, "Invalid step options in file: %s at line %zu\n",
+              step_seq_path, real_index);
+      goto close_step_seq_file;
     }
 
-    data.step_sequence_l[index] = step_l;
-    data.step_sequence_r[index] = step_r;
     index++;
   }
+  fclose(step_seq_file);
+
+  if (index != sequence->first + sequence->length) {
+    fprintf(stderr, "Step sequence file changed while loading: %s\n",
+            step_seq_path);
+    return false;
+  }
 
-  return data;
+  size_t duplicate = 0;
+  if (!label_table_build(&sequence->labels,
+                         data->step_sequence_label + sequence->first,
+                         sequence->length, &duplicate)) {
+    if (duplicate == SIZE_MAX) {
+      fprintf(stderr, "Failed to allocate label table\n");
+      return false;
+    }
+    fprintf(stderr, "Repeated step label '%s' in file: %s\n",
+            data->step_sequence_label[sequence->first + duplicate],
+            step_seq_path);
+    return false;
+  }
 
-free_step_sequence:
-  free(data.step_sequence_l);
-  free(data.step_sequence_r);
-free_sample:
-  free(data.sample);
-close_sample_file:
-  fclose(sample_file);
+  for (size_t i = sequence->first; i < sequence->first + sequence->length;
+       i++) {
+    if (data->step_sequence_next[i] &&
+        !parse_transitions(data, sequence, data->step_sequence_next[i], NULL,
+                           NULL)) {
+      fprintf(stderr, "Invalid next=%s in file: %s\n",
+              data->step_sequence_next[i], step_seq_path);
+      return false;
+    }
+  }
+
+  return true;
+
+close_step_seq_file:
+  fclose(step_seq_file);
+  return false;
+}
+
+// Loads every sequence of `config` into one allocation. `data->sample_length`
+// must be set already, to validate the steps.
+bool load_sequences(const Config *config, Data *data) {
+  size_t total_steps = 0;
+  size_t pool_size = 0;
+  size_t *steps = (size_t *)calloc(config->sequence_count, sizeof(size_t));
+
+  if (!steps) {
+    fprintf(stderr, "Failed to allocate step sequences\n");
+    return false;
+  }
+
+  for (size_t i = 0; i < config->sequence_count; i++) {
+    size_t label_bytes;
+    if (!count_steps(config->sequences[i].step_seq_path, &steps[i],
+                     &label_bytes)) {
+      free(steps);
+      return false;
+    }
+    total_steps += steps[i];
+    pool_size += label_bytes + strlen(config->sequences[i].name) + 1;
+  }
+
+  // Laid out from the strictest alignment down
+  size_t sequences_size = config->sequence_count * sizeof(Sequence);
+  size_t l_offset = sequences_size;
+  size_t r_offset = l_offset + total_steps * sizeof(size_t);
+  size_t label_offset = r_offset + total_steps * sizeof(size_t);
+  size_t next_offset = label_offset + total_steps * sizeof(char *);
+  size_t rate_offset = next_offset + total_steps * sizeof(char *);
+  size_t weight_offset = rate_offset + total_steps * sizeof(float);
+  size_t pool_offset = weight_offset + total_steps * sizeof(float);
+
+  char *arena = (char *)malloc(pool_offset + pool_size);
+  if (!arena) {
+    fprintf(stderr, "Failed to allocate step sequences\n");
+    free(steps);
+    return false;
+  }
+
+  data->arena = arena;
+  data->sequences = (Sequence *)arena;
+  data->sequence_count = config->sequence_count;
+  data->step_sequence_l = (size_t *)(arena + l_offset);
+  data->step_sequence_r = (size_t *)(arena + r_offset);
+  data->step_sequence_label = (char **)(arena + label_offset);
+  data->step_sequence_next = (char **)(arena + next_offset);
+  data->step_sequence_rate = (float *)(arena + rate_offset);
+  data->step_sequence_weight = (float *)(arena + weight_offset);
+  data->step_sequence_length = total_steps;
+  data->label_pool = arena + pool_offset;
+  data->label_pool_used = 0;
+
+  for (size_t i = 0; i < config->sequence_count; i++) {
+    data->sequences[i].labels.slots = NULL;
+  }
+
+  size_t first = 0;
+  for (size_t i = 0; i < config->sequence_count; i++) {
+    Sequence *sequence = &data->sequences[i];
+    size_t name_len = strlen(config->sequences[i].name);
+    sequence->name = data->label_pool + data->label_pool_used;
+    memcpy(sequence->name, config->sequences[i].name, name_len + 1);
+    data->label_pool_used += name_len + 1;
+
+    sequence->first = first;
+    sequence->length = steps[i];
+
+    if (!parse_steps(config->sequences[i].step_seq_path, data, sequence)) {
+      goto free_arena;
+    }
+    first += sequence->length;
+  }
+
+  free(steps);
+  return true;
+
+free_arena:
+  for (size_t i = 0; i < config->sequence_count; i++) {
+    label_table_free(&data->sequences[i].labels);
+  }
+  free(arena);
+  free(steps);
+  data->arena = NULL;
+  return false;
+}
+
+static void free_sequences(Data *data) {
+  for (size_t i = 0; data->arena && i < data->sequence_count; i++) {
+    label_table_free(&data->sequences[i].labels);
+  }
+  free(data->arena);
+  data->arena = NULL;
+}
+
+// Where the f32 mono frames of the sample are read from: `converted` if it
+// is set, otherwise `fd` from byte `offset` on.
+//
+// WAVs that need converting are only converted by `convert_sample_source`,
+// so that is skipped when a shared image of the sample exists already.
+struct sample_source {
+  int fd;
+  off_t offset;
+  size_t frames;
+  float *converted;
+  bool convert;
+  wav_info wav;
+};
+
+// Reads `frames` frames at frame `offset` of the sample into `out`.
+static bool read_sample_frames(const struct sample_source *source, float *out,
+                               size_t offset, size_t frames) {
+  if (source->converted) {
+    memcpy(out, source->converted + offset, frames * sizeof(float));
+    return true;
+  }
+
+  size_t size = frames * sizeof(float);
+  off_t base = source->offset + (off_t)(offset * sizeof(float));
+  for (size_t done = 0; done < size;) {
+    ssize_t n = pread(source->fd, (char *)out + done, size - done, base + done);
+    if (n <= 0) {
+      return false;
+    }
+    done += (size_t)n;
+  }
+  return true;
+}
+
+// Opens the sample at `path`, which is one of:
+// - A float mono 44100Hz WAV, read from its data chunk as it is.
+// - Any other WAV this reader knows, converted in memory.
+// - A file libsndfile knows, if built with it, decoded to a raw image.
+// - Raw f32le mono.
+static bool open_sample_source(const Config *config, const char *path,
+                               struct sample_source *source) {
+  source->fd = open(path, O_RDONLY | O_CLOEXEC);
+  source->offset = 0;
+  source->converted = NULL;
+  source->convert = false;
+
+  if (source->fd < 0) {
+    fprintf(stderr, "Failed to open sample file: %s\n", path);
+    return false;
+  }
+
+  wav_info wav = {0};
+  int res = wav_parse(source->fd, &wav);
+
+  if (res == WAV_OK && wav_is_native(&wav)) {
+    source->offset = wav.data_offset;
+    source->frames = wav.data_size / sizeof(float);
+    return true;
+  }
+
+  if (res == WAV_OK) {
+    source->wav = wav;
+    source->convert = true;
+    source->frames = wav_frames(&wav);
+    return true;
+  }
+
+  bool decoded;
+  int decoded_fd = decode_open_sample(config, path, &decoded);
+  if (decoded) {
+    close(source->fd);
+    source->fd = decoded_fd;
+    if (decoded_fd < 0) {
+      return false;
+    }
+  } else if (res == WAV_UNSUPPORTED) {
+    fprintf(stderr,
+            "Unsupported WAV format (16/24/32 bit PCM or 32 bit float "
+            "expected): %s\n",
+            path);
+    close(source->fd);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(source->fd, &st) < 0) {
+    fprintf(stderr, "Failed to stat sample file: %s\n", path);
+    close(source->fd);
+    return false;
+  }
+  source->frames = (size_t)st.st_size / sizeof(float);
+  return true;
+}
+
+static bool convert_sample_source(struct sample_source *source,
+                                  const char *path) {
+  if (!source->convert) {
+    return true;
+  }
+
+  source->converted = wav_convert(source->fd, &source->wav, &source->frames);
+  source->convert = false;
+  if (!source->converted) {
+    fprintf(stderr, "Failed to convert WAV sample file: %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+static void close_sample_source(struct sample_source *source) {
+  if (source->fd >= 0) {
+    close(source->fd);
+  }
+  free(source->converted);
+}
+
+// Range of the sample used by some step, and where it is packed.
+struct sample_range {
+  size_t l;
+  size_t r;
+  size_t packed;
+};
+
+static int compare_sample_ranges(const void *a, const void *b) {
+  const struct sample_range *x = a;
+  const struct sample_range *y = b;
+  return x->l < y->l ? -1 : x->l > y->l;
+}
+
+// Merges the ranges of every step into sorted, disjoint ranges and sets where
+// each of them starts once packed. Returns the amount of ranges, or SIZE_MAX
+// if out of memory.
+static size_t merge_step_ranges(const Data *data,
+                                struct sample_range **ranges) {
+  size_t n = 0;
+  *ranges = (struct sample_range *)malloc(
+      (data->step_sequence_length + 1) * sizeof(struct sample_range));
+  if (!*ranges) {
+    return SIZE_MAX;
+  }
+
+  for (size_t i = 0; i < data->step_sequence_length; i++) {
+    if (data->step_sequence_l[i] < data->step_sequence_r[i]) {
+      (*ranges)[n].l = data->step_sequence_l[i];
+      (*ranges)[n].r = data->step_sequence_r[i];
+      n++;
+    }
+  }
+  qsort(*ranges, n, sizeof(struct sample_range), compare_sample_ranges);
+
+  size_t merged = 0;
+  for (size_t i = 0; i < n; i++) {
+    // Overlapping or adjacent to the previous one
+    if (merged > 0 && (*ranges)[i].l <= (*ranges)[merged - 1].r) {
+      if ((*ranges)[i].r > (*ranges)[merged - 1].r) {
+        (*ranges)[merged - 1].r = (*ranges)[i].r;
+      }
+      continue;
+    }
+    (*ranges)[merged++] = (*ranges)[i];
+  }
+
+  size_t packed = 0;
+  for (size_t i = 0; i < merged; i++) {
+    (*ranges)[i].packed = packed;
+    packed += (*ranges)[i].r - (*ranges)[i].l;
+  }
+  return merged;
+}
+
+// Moves the steps from the original sample to the packed one.
+static void remap_steps(Data *data, const struct sample_range *ranges,
+                        size_t n) {
+  for (size_t i = 0; i < data->step_sequence_length; i++) {
+    size_t l = data->step_sequence_l[i];
+    size_t length = data->step_sequence_r[i] - l;
+    if (length == 0) {
+      data->step_sequence_l[i] = 0;
+      data->step_sequence_r[i] = 0;
+      continue;
+    }
+
+    // Last range starting at or before `l`, which contains the whole step
+    size_t lo = 0;
+    size_t hi = n;
+    while (hi - lo > 1) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (ranges[mid].l <= l) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+
+    data->step_sequence_l[i] = ranges[lo].packed + (l - ranges[lo].l);
+    data->step_sequence_r[i] = data->step_sequence_l[i] + length;
+  }
+}
+
+static size_t packed_frames(const struct sample_range *ranges, size_t n) {
+  return n > 0 ? ranges[n - 1].packed + ranges[n - 1].r - ranges[n - 1].l : 0;
+}
+
+// Loads only `ranges` of the sample, packed together. The packed image is
+// cached in `cache.dir`. The steps are remapped by the caller.
+static bool load_sample_trimmed(const Config *config,
+                                const struct sample_source *source,
+                                const struct sample_range *ranges, size_t n,
+                                Data *data) {
+  const char *sample_path = config->options.single_sample.sample_path;
+  size_t packed = packed_frames(ranges, n);
+  float *sample = (float *)malloc(packed * sizeof(float) + 1);
+  if (!sample) {
+    fprintf(stderr, "Failed to allocate sample\n");
+    return false;
+  }
+
+  // The image depends on the sample file and on which ranges are kept
+  char path[4096];
+  bool cached = false;
+  uint64_t key = CACHE_KEY_INIT;
+  bool use_cache = config->cache.dir[0] != '\0' &&
+                   cache_key_add_file(&key, sample_path);
+  if (use_cache) {
+    for (size_t i = 0; i < n; i++) {
+      key = cache_key_add(key, &ranges[i].l, 2 * sizeof(size_t));
+    }
+    cache_path(path, sizeof(path), config->cache.dir, "trim", key);
+    cached = cache_read(path, sample, packed * sizeof(float));
+  }
+
+  if (!cached) {
+    for (size_t i = 0; i < n; i++) {
+      if (!read_sample_frames(source, sample + ranges[i].packed, ranges[i].l,
+                              ranges[i].r - ranges[i].l)) {
+        fprintf(stderr, "Failed to read sample data from file: %s\n",
+                sample_path);
+        free(sample);
+        return false;
+      }
+    }
+    if (use_cache) {
+      cache_write(config->cache.dir, path, sample, packed * sizeof(float));
+    }
+  }
+
+  printf("Trimmed sample from %zu to %zu frames in %zu ranges%s\n",
+         data->sample_length, packed, n, cached ? " (cached)" : "");
+
+  data->sample = sample;
+  data->sample_length = packed;
+  return true;
+}
+
+// Frees the sample, whichever of `sample` and `sample_encoded` holds it.
+static void free_sample(Data *data) {
+  if (data->sample_map) {
+    munmap(data->sample_map, data->sample_mapped);
+    if (data->sample_fd >= 0) {
+      close(data->sample_fd);
+    }
+  } else {
+    free(data->sample);
+    free(data->sample_encoded);
+  }
+  data->sample = NULL;
+  data->sample_encoded = NULL;
+  data->sample_map = NULL;
+  data->sample_mapped = 0;
+}
+
+// Makes the image `offset` bytes into the `mapped` bytes long mapping `map`
+// of `fd` the sample, in place of the current one. Takes `fd`, which is -1
+// for anonymous memory.
+static void use_sample_map(Data *data, void *map, size_t mapped, int fd,
+                           off_t offset) {
+  free_sample(data);
+  if (data->sample_encoding == ENCODING_F32) {
+    data->sample = (float *)((char *)map + offset);
+  } else {
+    data->sample_encoded = (char *)map + offset;
+  }
+  data->sample_map = map;
+  data->sample_mapped = mapped;
+  data->sample_fd = fd;
+  data->sample_offset = offset;
+}
+
+// Maps the raw f32 image of `source` as the sample, instead of copying it.
+// The pages are populated up front so `on_process` does not fault them in.
+// Returns false if it cannot be mapped.
+static bool map_sample(const struct sample_source *source, Data *data) {
+  size_t size = (size_t)source->offset + source->frames * sizeof(float);
+  if (source->fd < 0 || source->convert || source->frames == 0) {
+    return false;
+  }
+
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                   source->fd, 0);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  use_sample_map(data, map, size, fcntl(source->fd, F_DUPFD_CLOEXEC, 0),
+                 source->offset);
+  return true;
+}
+
+// Replaces the f32 sample with its `encoding`. Returns false if out of memory.
+bool encode_sample(Data *data, SampleEncoding encoding) {
+  void *encoded = NULL;
+
+  switch (encoding) {
+  case ENCODING_F32:
+    return true;
+  case ENCODING_S16:
+    encoded = malloc(data->sample_length * sizeof(int16_t) + 1);
+    if (encoded) {
+      encode_s16((int16_t *)encoded, data->sample, data->sample_length);
+    }
+    break;
+  case ENCODING_ADPCM:
+    encoded = malloc(adpcm_blocks(data->sample_length) * sizeof(adpcm_block) +
+                     1);
+    if (encoded) {
+      encode_adpcm((adpcm_block *)encoded, data->sample, data->sample_length);
+    }
+    break;
+  }
+
+  if (!encoded) {
+    return false;
+  }
+
+  free_sample(data);
+  data->sample_encoding = encoding;
+  data->sample_encoded = encoded;
+  return true;
+}
+
+// Bytes taken by the sample in memory
+static size_t sample_image_size(SampleEncoding encoding, size_t frames) {
+  switch (encoding) {
+  case ENCODING_S16:
+    return frames * sizeof(int16_t);
+  case ENCODING_ADPCM:
+    return adpcm_blocks(frames) * sizeof(adpcm_block);
+  case ENCODING_F32:
+  default:
+    return frames * sizeof(float);
+  }
+}
+
+size_t sample_size(const Data *data) {
+  return sample_image_size(data->sample_encoding, data->sample_length);
+}
+
+// Images shared between instances, see `cache.shared`
+#define SHARED_DIR "/dev/shm"
+
+// Identifies the final image of the sample: the sample file, the ranges kept
+// and the encoding. Returns false if the sample file cannot be read.
+static bool shared_sample_key(const Config *config,
+                              const struct sample_range *ranges, size_t n,
+                              uint64_t *key) {
+  const char *sample_path = config->options.single_sample.sample_path;
+  int rate = DECODE_RATE;
+  bool trim = config->options.single_sample.trim;
+  SampleEncoding encoding = config->options.single_sample.encoding;
+
+  *key = CACHE_KEY_INIT;
+  if (!cache_key_add_file(key, sample_path) ||
+      !cache_key_add_content(key, sample_path)) {
+    return false;
+  }
+  *key = cache_key_add(*key, &rate, sizeof(rate));
+  *key = cache_key_add(*key, &trim, sizeof(trim));
+  *key = cache_key_add(*key, &encoding, sizeof(encoding));
+  for (size_t i = 0; i < n; i++) {
+    *key = cache_key_add(*key, &ranges[i].l, 2 * sizeof(size_t));
+  }
+  return true;
+}
+
+// Maps the shared image at `path` as the sample, in place of the current
+// one, if it is `size` bytes long and trusted, see `cache_trusted`.
+static bool map_shared_sample(const char *path, size_t size, Data *data) {
+  int fd = cache_open(path, size);
+  if (fd < 0) {
+    return false;
+  }
+
+  void *map = MAP_FAILED;
+  if (size > 0) {
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+  }
+
+  if (map == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  use_sample_map(data, map, size, fd, 0);
+  return true;
+}
+
+// Moves the sample to a shared image at `path`, so other instances map the
+// same pages instead of preparing their own copy.
+static void share_sample(const char *path, Data *data) {
+  const void *image = data->sample_encoding == ENCODING_F32
+                          ? (const void *)data->sample
+                          : data->sample_encoded;
+  cache_write(SHARED_DIR, path, image, sample_size(data));
+  if (!map_shared_sample(path, sample_size(data), data)) {
+    fprintf(stderr, "Failed to share sample, keeping a private copy\n");
+  }
+}
+
+// Copies frames [from, from + n) of the sample into `out`. RT-safe.
+static inline void sample_decode(const Data *data, size_t from, size_t n,
+                                 float *out) {
+  switch (data->sample_encoding) {
+  case ENCODING_F32:
+    memcpy(out, data->sample + from, n * sizeof(float));
+    break;
+  case ENCODING_S16:
+    decode_s16(out, (const int16_t *)data->sample_encoded + from, n);
+    break;
+  case ENCODING_ADPCM:
+    decode_adpcm(out, (const adpcm_block *)data->sample_encoded, from, n);
+    break;
+  }
+}
+
+// Page aligned range holding bytes [from, to) of the sample image. Sets
+// `*length` to its size.
+static char *sample_pages(const Data *data, size_t from, size_t to,
+                          size_t *length) {
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  const char *image = data->sample_encoding == ENCODING_F32
+                          ? (const char *)data->sample
+                          : (const char *)data->sample_encoded;
+  uintptr_t start = ((uintptr_t)image + from) & ~(page - 1);
+  uintptr_t end = ((uintptr_t)image + to + page - 1) & ~(page - 1);
+  *length = end - start;
+  return (char *)start;
+}
+
+// Lets the kernel reclaim the pages of the sample while it is not played,
+// see `idle.release`. They come back from the file or swap when touched.
+void sample_release(const Data *data, IdleRelease release) {
+  size_t length;
+  char *pages = sample_pages(data, 0, sample_size(data), &length);
+
+  if (release == IDLE_RELEASE_PAGEOUT &&
+      madvise(pages, length, MADV_PAGEOUT) == 0) {
+    return;
+  }
+  // Kernels before 5.4 know neither
+  if (madvise(pages, length, MADV_COLD) < 0) {
+    perror("madvise");
+  }
+}
+
+// Faults in the pages holding frames [from, to) of the sample, so playing
+// them does not page fault in `on_process`.
+void sample_prefetch(const Data *data, size_t from, size_t to) {
+  size_t first = from;
+  if (data->sample_encoding == ENCODING_ADPCM) {
+    // The whole block is decoded
+    first = from / ADPCM_BLOCK * ADPCM_BLOCK;
+  }
+
+  size_t length;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  char *pages = sample_pages(
+      data, sample_image_size(data->sample_encoding, first),
+      sample_image_size(data->sample_encoding, to), &length);
+
+  madvise(pages, length, MADV_WILLNEED);
+  for (size_t i = 0; i < length; i += page) {
+    (void)*(volatile const char *)(pages + i);
+  }
+}
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+// Maps `size` bytes of anonymous memory on 2 MB pages, from the hugetlbfs
+// pool if it has room and as transparent huge pages otherwise. Sets
+// `*mapped` to the length of the mapping. Returns NULL if neither works.
+static void *map_huge_pages(size_t size, size_t *mapped, bool *hugetlb) {
+  *mapped = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+  void *map = mmap(NULL, *mapped, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                   -1, 0);
+  *hugetlb = map != MAP_FAILED;
+  if (*hugetlb) {
+    return map;
+  }
+
+  // Over-allocate to cut a 2 MB aligned mapping out of it, transparent huge
+  // pages are only used for aligned ranges
+  size_t padded = *mapped + HUGE_PAGE_SIZE;
+  char *raw = (char *)mmap(NULL, padded, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    return NULL;
+  }
+
+  char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) &
+                           ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+  if (aligned > raw) {
+    munmap(raw, aligned - raw);
+  }
+  munmap(aligned + *mapped, raw + padded - (aligned + *mapped));
+
+  if (madvise(aligned, *mapped, MADV_HUGEPAGE) < 0) {
+    perror("madvise");
+    munmap(aligned, *mapped);
+    return NULL;
+  }
+  return aligned;
+}
+
+// Moves the sample to huge pages, so jumping between steps does not miss the
+// TLB on every 4 KB page. Samples mapped from a file or /dev/shm are copied
+// too, since the page cache ignores MADV_HUGEPAGE, so they are no longer
+// shared with other processes.
+static void move_sample_to_huge_pages(Data *data) {
+  size_t size = sample_size(data);
+
+  // Smaller samples fit in a handful of TLB entries anyway
+  if (size < HUGE_PAGE_SIZE) {
+    return;
+  }
+
+  size_t mapped;
+  bool hugetlb;
+  void *map = map_huge_pages(size, &mapped, &hugetlb);
+  if (!map) {
+    fprintf(stderr, "Failed to allocate huge pages, keeping the sample on "
+                    "regular pages\n");
+    return;
+  }
+
+  memcpy(map,
+         data->sample_encoding == ENCODING_F32 ? (const void *)data->sample
+                                               : data->sample_encoded,
+         size);
+  if (mprotect(map, mapped, PROT_READ) < 0) {
+    perror("mprotect");
+  }
+  if (data->sample_fd >= 0) {
+    printf("Copying the mapped sample to huge pages, it is no longer "
+           "shared\n");
+  }
+  use_sample_map(data, map, mapped, -1, 0);
+  printf("Sample on %s huge pages\n", hugetlb ? "hugetlbfs" : "transparent");
+}
+
+bool data_from_config_wav(const Config *config, Data *out) {
+  Data data = {0};
+
+  const char *sample_path = config->options.single_sample.sample_path;
+  bool trim = config->options.single_sample.trim;
+  SampleEncoding encoding = config->options.single_sample.encoding;
+  struct sample_range *ranges = NULL;
+  size_t range_count = 0;
+
+  // Load sample file
+  struct sample_source source;
+  if (!open_sample_source(config, sample_path, &source)) {
+    goto exit_failure;
+  }
+  data.sample_length = source.frames;
+
+  // Load step sequence files
+  if (!load_sequences(config, &data)) {
+    goto close_source;
+  }
+
+  size_t frames = source.frames;
+  if (trim) {
+    range_count = merge_step_ranges(&data, &ranges);
+    if (range_count == SIZE_MAX) {
+      fprintf(stderr, "Failed to allocate sample ranges\n");
+      ranges = NULL;
+      goto close_source;
+    }
+    frames = packed_frames(ranges, range_count);
+  }
+
+  // A sample file mapped as it is is shared through the page cache already
+  char shared_path[4096];
+  uint64_t key;
+  bool keyed = shared_sample_key(config, ranges, range_count, &key);
+  bool shared = config->cache.shared &&
+                (trim || source.convert || encoding != ENCODING_F32) && keyed;
+  if (shared) {
+    cache_path(shared_path, sizeof(shared_path), SHARED_DIR, "mbas", key);
+  }
+
+  data.source_length = source.frames;
+  data.image_key = keyed ? key : 0;
+  data.sample_encoding = encoding;
+  if (shared && map_shared_sample(shared_path,
+                                  sample_image_size(encoding, frames), &data)) {
+    printf("Using shared sample: %s\n", shared_path);
+    data.sample_length = frames;
+  } else {
+    data.sample_encoding = ENCODING_F32;
+
+    if (!convert_sample_source(&source, sample_path)) {
+      goto close_source;
+    }
+
+    if (trim) {
+      if (!load_sample_trimmed(config, &source, ranges, range_count, &data)) {
+        goto close_source;
+      }
+    } else if (source.converted) {
+      data.sample = source.converted;
+      source.converted = NULL;
+    } else if (!map_sample(&source, &data)) {
+      data.sample = (float *)malloc(data.sample_length * sizeof(float) + 1);
+      if (!data.sample ||
+          !read_sample_frames(&source, data.sample, 0, data.sample_length)) {
+        fprintf(stderr, "Failed to read sample data from file: %s\n",
+                sample_path);
+        free(data.sample);
+        goto close_source;
+      }
+    }
+
+    if (!encode_sample(&data, encoding)) {
+      fprintf(stderr, "Failed to allocate encoded sample\n");
+      free_sample(&data);
+      goto close_source;
+    }
+
+    if (shared) {
+      share_sample(shared_path, &data);
+    }
+  }
+
+  if (trim) {
+    remap_steps(&data, ranges, range_count);
+    free(ranges);
+  }
+  close_sample_source(&source);
+
+  if (config->memory.huge_pages) {
+    move_sample_to_huge_pages(&data);
+  }
+
+  printf("Sample takes %zu KiB (%zu KiB as f32)\n", sample_size(&data) / 1024,
+         data.sample_length * sizeof(float) / 1024);
+  *out = data;
+  return true;
+
+close_source:
+  free(ranges);
+  close_sample_source(&source);
 exit_failure:
-  exit(EXIT_FAILURE);
+  return false;
 }
 
-Data data_from_config(const Config *config) {
+// Sample image handed from one process to the next, see `upgrade` in main.c
+struct sample_image {
+  int fd;
+  // Where the image starts in `fd`
+  off_t offset;
+  uint64_t key;
+  SampleEncoding encoding;
+  size_t source_length;
+  size_t length;
+};
+
+typedef struct sample_image sample_image;
+
+// Copies the sample to a new memfd. Returns it, or -1.
+static int sample_copy(const Data *data) {
+  int fd = memfd_create("mbas-sample", 0);
+  if (fd < 0) {
+    perror("memfd_create");
+    return -1;
+  }
+
+  const char *bytes = data->sample_encoding == ENCODING_F32
+                          ? (const char *)data->sample
+                          : (const char *)data->sample_encoded;
+  size_t size = sample_size(data);
+  bool ok = true;
+  for (size_t done = 0; ok && done < size;) {
+    ssize_t n = write(fd, bytes + done, size - done);
+    ok = n > 0;
+    done += ok ? (size_t)n : 0;
+  }
+
+  if (!ok) {
+    perror("write");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Hands the sample to a process that maps it instead of loading it again:
+// the file behind its mapping if there is one, otherwise a copy, since only
+// samples in anonymous memory have nothing to share. Returns false on
+// failure.
+bool sample_export(const Data *data, sample_image *image) {
+  image->offset = 0;
+  if (data->sample_map && data->sample_fd >= 0) {
+    // Without FD_CLOEXEC, so it is inherited across the exec
+    image->fd = dup(data->sample_fd);
+    image->offset = data->sample_offset;
+    if (image->fd < 0) {
+      perror("dup");
+    }
+  } else {
+    image->fd = sample_copy(data);
+  }
+  if (image->fd < 0) {
+    return false;
+  }
+
+  image->key = data->image_key;
+  image->encoding = data->sample_encoding;
+  image->source_length = data->source_length;
+  image->length = data->sample_length;
+  return true;
+}
+
+// Like `data_from_config`, but maps the sample from `image` instead of
+// loading it. The steps are read again. Returns false if `config` does not
+// lead to the same image anymore, or on failure.
+bool data_from_image(const Config *config, const sample_image *image,
+                     Data *out) {
+  Data data = {0};
+  struct sample_range *ranges = NULL;
+  size_t range_count = 0;
+  bool trim = config->options.single_sample.trim;
+
+  data.sample_length = image->source_length;
+  if (!load_sequences(config, &data)) {
+    return false;
+  }
+
+  if (trim) {
+    range_count = merge_step_ranges(&data, &ranges);
+    if (range_count == SIZE_MAX) {
+      fprintf(stderr, "Failed to allocate sample ranges\n");
+      ranges = NULL;
+      goto free_data;
+    }
+  }
+
+  uint64_t key;
+  if (image->key == 0 ||
+      !shared_sample_key(config, ranges, range_count, &key) ||
+      key != image->key) {
+    printf("Sample changed since the previous process loaded it\n");
+    goto free_data;
+  }
+
+  size_t size = (size_t)image->offset +
+                sample_image_size(image->encoding, image->length);
+  void *map = size > (size_t)image->offset
+                  ? mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+                         image->fd, 0)
+                  : MAP_FAILED;
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    goto free_data;
+  }
+
+  // The caller closes `image->fd`
+  data.sample_encoding = image->encoding;
+  use_sample_map(&data, map, size, fcntl(image->fd, F_DUPFD_CLOEXEC, 0),
+                 image->offset);
+  data.sample_length = image->length;
+  data.source_length = image->source_length;
+  data.image_key = key;
+
+  if (trim) {
+    remap_steps(&data, ranges, range_count);
+    free(ranges);
+  }
+
+  if (config->memory.huge_pages) {
+    move_sample_to_huge_pages(&data);
+  }
+
+  printf("Using the sample of the previous process, %zu KiB\n",
+         sample_size(&data) / 1024);
+  *out = data;
+  return true;
+
+free_data:
+  free(ranges);
+  free_sequences(&data);
+  return false;
+}
+
+// Loads everything `config` refers to into `data`. Returns false, after
+// printing why, if anything is missing or invalid.
+bool data_from_config(const Config *config, Data *data) {
   switch (config->mode) {
   case MODE_SINGLE_SAMPLE: {
-    return data_from_config_wav(config);
+    return data_from_config_wav(config, data);
   }
   default:
     fprintf(stderr,
             "Unsupported mode in config. This should not be possible.\n");
-    exit(EXIT_FAILURE);
+    return false;
   }
 }
+
+#endif
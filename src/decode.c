@@ -0,0 +1,221 @@
+#ifndef MBAS_DECODE_C
+#define MBAS_DECODE_C
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.c"
+#include "config.c"
+#include "dsp.c"
+
+// Rate samples are played at, the same as the output stream
+#define DECODE_RATE 44100
+
+// Length of `n` frames at `rate` Hz once resampled to DECODE_RATE
+static inline size_t decode_resampled_frames(size_t n, int rate) {
+  return (size_t)((double)n * DECODE_RATE / rate);
+}
+
+// Sinc used to resample files, with 4 times as many taps as the one of
+// playback since it runs once. Its cutoff at 0.9 times the lower Nyquist
+// frequency leaves it flat to 18.5 kHz and 80 dB down at 22.05 kHz, so
+// decimated content does not fold back.
+#define DECODE_SINC_HALF 32
+#define DECODE_SINC_CUTOFF 0.9
+
+static float decode_sinc_curve[DECODE_SINC_HALF * SINC_PHASES + 1];
+
+// Resamples `n` frames at `rate` Hz to DECODE_RATE, low-passing them below
+// the Nyquist frequency of the lower of the two rates, into a 64 byte aligned
+// buffer.
+static float *decode_resample(const float *x, size_t n, int rate,
+                              size_t *frames) {
+  double step = (double)rate / DECODE_RATE;
+  double stretch = (step > 1.0 ? step : 1.0) / DECODE_SINC_CUTOFF;
+  size_t out_n = decode_resampled_frames(n, rate);
+  size_t pad = (size_t)dsp_sinc_taps(DECODE_SINC_HALF, stretch);
+  float *padded = (float *)calloc(n + 2 * pad, sizeof(float));
+  float *out = (float *)aligned_alloc(
+      64, (((out_n + 1) * sizeof(float) + 63) & ~(size_t)63));
+
+  if (!padded || !out) {
+    free(padded);
+    free(out);
+    return NULL;
+  }
+
+  memcpy(padded + pad, x, n * sizeof(float));
+  dsp_init_sinc_curve(decode_sinc_curve, DECODE_SINC_HALF);
+  dsp_resample_sinc_curve(decode_sinc_curve, DECODE_SINC_HALF, stretch, out,
+                          padded, (double)pad, step, 1.0f, out_n);
+
+  free(padded);
+  *frames = out_n;
+  return out;
+}
+
+#ifdef MBAS_WITH_SNDFILE
+
+#include <sndfile.h>
+
+#define DECODE_CHUNK 4096
+
+// Writes `n` frames to an unlinked temporary file. Returns its fd, or -1.
+static int decode_temp_image(const float *frames, size_t n) {
+  FILE *file = tmpfile();
+  if (!file) {
+    return -1;
+  }
+
+  int fd = dup(fileno(file));
+  bool ok = fd >= 0 && fwrite(frames, sizeof(float), n, file) == n &&
+            fflush(file) == 0;
+  fclose(file);
+
+  if (!ok) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+// Reads every frame of `sf`, downmixed to mono. Returns NULL on error.
+static float *decode_sndfile(SNDFILE *sf, const SF_INFO *info,
+                             size_t *frames) {
+  size_t capacity = info->frames > 0 ? (size_t)info->frames : DECODE_CHUNK;
+  float *mono = (float *)malloc(capacity * sizeof(float));
+  float *chunk =
+      (float *)malloc(DECODE_CHUNK * (size_t)info->channels * sizeof(float));
+  size_t n = 0;
+
+  if (!mono || !chunk) {
+    goto fail;
+  }
+
+  sf_count_t got;
+  while ((got = sf_readf_float(sf, chunk, DECODE_CHUNK)) > 0) {
+    if (n + (size_t)got > capacity) {
+      capacity = 2 * (n + (size_t)got);
+      float *grown = (float *)realloc(mono, capacity * sizeof(float));
+      if (!grown) {
+        goto fail;
+      }
+      mono = grown;
+    }
+
+    for (sf_count_t i = 0; i < got; i++) {
+      float sum = 0.0f;
+      for (int c = 0; c < info->channels; c++) {
+        sum += chunk[i * info->channels + c];
+      }
+      mono[n++] = sum / (float)info->channels;
+    }
+  }
+
+  free(chunk);
+  *frames = n;
+  return mono;
+
+fail:
+  free(mono);
+  free(chunk);
+  return NULL;
+}
+
+// Opens the raw f32le mono image of the audio file at `path`, decoding it
+// unless a cached one is found. Sets `*decoded` to false and returns -1 if
+// libsndfile does not recognise the file, which is then read as raw f32le.
+int decode_open_sample(const Config *config, const char *path,
+                       bool *decoded) {
+  SF_INFO info = {0};
+  SNDFILE *sf = sf_open(path, SFM_READ, &info);
+  *decoded = sf != NULL;
+  if (!sf) {
+    return -1;
+  }
+
+  // The cached image is only used if it has as many frames as the file
+  // says it holds, which rules out images cut short or planted by someone
+  // else
+  size_t expected = info.frames > 0 ? (size_t)info.frames : 0;
+  if (info.samplerate != DECODE_RATE) {
+    expected = decode_resampled_frames(expected, info.samplerate);
+  }
+
+  char cache_file[4096];
+  uint64_t key = CACHE_KEY_INIT;
+  int rate = DECODE_RATE;
+  bool use_cache = config->cache.dir[0] != '\0' && expected > 0 &&
+                   cache_key_add_file(&key, path) &&
+                   cache_key_add_content(&key, path);
+  if (use_cache) {
+    key = cache_key_add(key, &rate, sizeof(rate));
+    cache_path(cache_file, sizeof(cache_file), config->cache.dir, "decoded",
+               key);
+
+    int fd = cache_open(cache_file, expected * sizeof(float));
+    if (fd >= 0) {
+      sf_close(sf);
+      printf("Using decoded sample from cache: %s\n", cache_file);
+      return fd;
+    }
+  }
+
+  size_t frames = 0;
+  float *mono = decode_sndfile(sf, &info, &frames);
+  sf_close(sf);
+  if (!mono) {
+    fprintf(stderr, "Failed to decode sample file: %s\n", path);
+    return -1;
+  }
+
+  if (info.samplerate != DECODE_RATE) {
+    size_t resampled_frames;
+    float *resampled =
+        decode_resample(mono, frames, info.samplerate, &resampled_frames);
+    free(mono);
+    if (!resampled) {
+      fprintf(stderr, "Failed to resample sample file: %s\n", path);
+      return -1;
+    }
+    mono = resampled;
+    frames = resampled_frames;
+  }
+
+  printf("Decoded %s: %zu frames\n", path, frames);
+
+  int fd = -1;
+  if (use_cache && frames == expected) {
+    cache_write(config->cache.dir, cache_file, mono, frames * sizeof(float));
+    fd = cache_open(cache_file, frames * sizeof(float));
+  }
+  if (fd < 0) {
+    fd = decode_temp_image(mono, frames);
+  }
+  free(mono);
+
+  if (fd < 0) {
+    fprintf(stderr, "Failed to store decoded sample: %s\n", path);
+  }
+  return fd;
+}
+
+#else
+
+int decode_open_sample(const Config *config, const char *path,
+                       bool *decoded) {
+  (void)config;
+  (void)path;
+  *decoded = false;
+  return -1;
+}
+
+#endif
+
+#endif
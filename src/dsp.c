@@ -0,0 +1,303 @@
+#ifndef MBAS_DSP_C
+#define MBAS_DSP_C
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "config.c"
+
+// Small SIMD kernels used by the render loop.
+//
+// Written with GCC/Clang vector extensions so they map to SSE on x86 and NEON
+// on ARM without intrinsics. Loads and stores go through memcpy so the
+// buffers need no particular alignment.
+
+typedef float v4f __attribute__((vector_size(16)));
+
+static inline v4f v4f_load(const float *p) {
+  v4f v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void v4f_store(float *p, v4f v) { memcpy(p, &v, sizeof(v)); }
+
+static inline v4f v4f_splat(float x) { return (v4f){x, x, x, x}; }
+
+// sum(a[i] * b[i])
+static inline float dsp_dot(const float *a, const float *b, size_t n) {
+  v4f acc0 = v4f_splat(0.0f);
+  v4f acc1 = v4f_splat(0.0f);
+  size_t vn = n & ~(size_t)7;
+  for (size_t i = 0; i < vn; i += 8) {
+    acc0 += v4f_load(a + i) * v4f_load(b + i);
+    acc1 += v4f_load(a + i + 4) * v4f_load(b + i + 4);
+  }
+  acc0 += acc1;
+  float sum = acc0[0] + acc0[1] + acc0[2] + acc0[3];
+  for (size_t i = vn; i < n; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+// out[i] = x[i] * gain. A plain copy at unity gain. `out` may be `x`.
+static inline void dsp_scale(float *out, const float *x, float gain,
+                             size_t n) {
+  if (gain == 1.0f) {
+    if (out != x) {
+      memcpy(out, x, n * sizeof(float));
+    }
+    return;
+  }
+  v4f g = v4f_splat(gain);
+  size_t vn = n & ~(size_t)3;
+  for (size_t i = 0; i < vn; i += 4) {
+    v4f_store(out + i, v4f_load(x + i) * g);
+  }
+  for (size_t i = vn; i < n; i++) {
+    out[i] = x[i] * gain;
+  }
+}
+
+// out[i] = a[i] * w[i]
+static inline void dsp_mul(float *out, const float *a, const float *w,
+                           size_t n) {
+  size_t vn = n & ~(size_t)3;
+  for (size_t i = 0; i < vn; i += 4) {
+    v4f_store(out + i, v4f_load(a + i) * v4f_load(w + i));
+  }
+  for (size_t i = vn; i < n; i++) {
+    out[i] = a[i] * w[i];
+  }
+}
+
+// out[i] = a[i] + b[i] * w[i]
+static inline void dsp_mul_add(float *out, const float *a, const float *b,
+                               const float *w, size_t n) {
+  size_t vn = n & ~(size_t)3;
+  for (size_t i = 0; i < vn; i += 4) {
+    v4f_store(out + i, v4f_load(a + i) + v4f_load(b + i) * v4f_load(w + i));
+  }
+  for (size_t i = vn; i < n; i++) {
+    out[i] = a[i] + b[i] * w[i];
+  }
+}
+
+// Windowed sinc, tabulated for `SINC_PHASES` fractional positions
+#define SINC_TAPS 16
+#define SINC_PHASES 256
+
+static float sinc_table[SINC_PHASES + 1][SINC_TAPS];
+
+// The same sinc against the distance from its center, every 1 / SINC_PHASES
+// frames, for the stretched kernels of `dsp_resample_sinc_curve`
+static float sinc_curve[SINC_TAPS / 2 * SINC_PHASES + 1];
+
+// Windowed sinc with `half` zero crossings on each side, at distance `x` from
+// its center
+static double dsp_sinc(double x, int half) {
+  double sinc = x == 0.0 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+  // Blackman window over [-half, half]
+  double t = (x + half) / (2.0 * half);
+  return sinc * (0.42 - 0.5 * cos(2.0 * M_PI * t) + 0.08 * cos(4.0 * M_PI * t));
+}
+
+// Tabulates the sinc with `half` zero crossings on each side into `curve`,
+// `half * SINC_PHASES + 1` entries long
+static void dsp_init_sinc_curve(float *curve, int half) {
+  for (int i = 0; i <= half * SINC_PHASES; i++) {
+    curve[i] = (float)dsp_sinc((double)i / SINC_PHASES, half);
+  }
+}
+
+static void dsp_init_sinc_table(void) {
+  for (int phase = 0; phase <= SINC_PHASES; phase++) {
+    double frac = (double)phase / SINC_PHASES;
+    double sum = 0.0;
+    for (int tap = 0; tap < SINC_TAPS; tap++) {
+      // Distance from the tap to the interpolated position
+      double w =
+          dsp_sinc((double)(tap - (SINC_TAPS / 2 - 1)) - frac, SINC_TAPS / 2);
+      sinc_table[phase][tap] = (float)w;
+      sum += w;
+    }
+    // Unity gain at DC for every phase
+    for (int tap = 0; tap < SINC_TAPS; tap++) {
+      sinc_table[phase][tap] /= (float)sum;
+    }
+  }
+
+  dsp_init_sinc_curve(sinc_curve, SINC_TAPS / 2);
+}
+
+// Taps on each side of the interpolated position of a sinc with `half` zero
+// crossings on each side, stretched `stretch` times
+static inline int dsp_sinc_taps(int half, double stretch) {
+  return (int)ceil(half * stretch);
+}
+
+// Taps of the sinc kernel on each side of the interpolated position at
+// `rate`. Above 1, the kernel is stretched by `rate` so its cutoff stays
+// below the Nyquist frequency of the output.
+static inline int dsp_sinc_reach(double rate) {
+  return rate > 1.0 ? dsp_sinc_taps(SINC_TAPS / 2, rate) : SINC_TAPS / 2;
+}
+
+// Reach of the `interp` kernel at `rate` around floor(position), in frames.
+// `dsp_resample` reads x[floor(p) - before, floor(p) + after] for every
+// output.
+static inline void dsp_reach(Interpolation interp, double rate, int *before,
+                             int *after) {
+  switch (interp) {
+  case INTERP_LINEAR:
+    *before = 0;
+    *after = 1;
+    break;
+  case INTERP_CUBIC:
+  default:
+    *before = 1;
+    *after = 2;
+    break;
+  case INTERP_SINC:
+    *after = dsp_sinc_reach(rate);
+    *before = *after - 1;
+    break;
+  }
+}
+
+static void dsp_resample_linear(float *out, const float *x, double pos,
+                                double rate, float gain, size_t n) {
+  v4f g = v4f_splat(gain);
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    v4f a, b, f;
+    for (int j = 0; j < 4; j++) {
+      double p = pos + (double)(k + j) * rate;
+      size_t i = (size_t)p;
+      a[j] = x[i];
+      b[j] = x[i + 1];
+      f[j] = (float)(p - (double)i);
+    }
+    v4f_store(out + k, (a + (b - a) * f) * g);
+  }
+  for (; k < n; k++) {
+    double p = pos + (double)k * rate;
+    size_t i = (size_t)p;
+    float f = (float)(p - (double)i);
+    out[k] = (x[i] + (x[i + 1] - x[i]) * f) * gain;
+  }
+}
+
+// Catmull-Rom flavour of cubic Hermite
+static void dsp_resample_cubic(float *out, const float *x, double pos,
+                               double rate, float gain, size_t n) {
+  for (size_t k = 0; k < n; k += 4) {
+    v4f xm1, x0, x1, x2, f;
+    size_t lanes = SPA_MIN(n - k, 4);
+    for (size_t j = 0; j < 4; j++) {
+      double p = pos + (double)(k + SPA_MIN(j, lanes - 1)) * rate;
+      size_t i = (size_t)p;
+      xm1[j] = x[i - 1];
+      x0[j] = x[i];
+      x1[j] = x[i + 1];
+      x2[j] = x[i + 2];
+      f[j] = (float)(p - (double)i);
+    }
+    v4f c1 = v4f_splat(0.5f) * (x1 - xm1);
+    v4f c2 = xm1 - v4f_splat(2.5f) * x0 + v4f_splat(2.0f) * x1 -
+             v4f_splat(0.5f) * x2;
+    v4f c3 = v4f_splat(0.5f) * (x2 - xm1) + v4f_splat(1.5f) * (x0 - x1);
+    v4f y = (((c3 * f + c2) * f + c1) * f + x0) * v4f_splat(gain);
+    if (lanes == 4) {
+      v4f_store(out + k, y);
+    } else {
+      for (size_t j = 0; j < lanes; j++) {
+        out[k + j] = y[j];
+      }
+    }
+  }
+}
+
+static void dsp_resample_sinc(float *out, const float *x, double pos,
+                              double rate, float gain, size_t n) {
+  for (size_t k = 0; k < n; k++) {
+    double p = pos + (double)k * rate;
+    size_t i = (size_t)p;
+    int phase = (int)((p - (double)i) * SINC_PHASES + 0.5);
+    out[k] = dsp_dot(x + i - (SINC_TAPS / 2 - 1), sinc_table[phase],
+                     SINC_TAPS) *
+             gain;
+  }
+}
+
+// Resamples like `dsp_resample` through the sinc tabulated in `curve`, see
+// `dsp_init_sinc_curve`, stretched `stretch` times, which divides its cutoff
+// by `stretch`. Taps are weighted by interpolating `curve`, and
+// `dsp_sinc_taps(half, stretch)` of them are read on each side.
+//
+// For rates above 1, stretching by the rate low-passes at the Nyquist
+// frequency of the output, so the input frames skipped do not alias.
+static void dsp_resample_sinc_curve(const float *curve, int half,
+                                    double stretch, float *out,
+                                    const float *x, double pos, double rate,
+                                    float gain, size_t n) {
+  int reach = dsp_sinc_taps(half, stretch);
+  double scale = SINC_PHASES / stretch;
+  for (size_t k = 0; k < n; k++) {
+    double p = pos + (double)k * rate;
+    size_t i = (size_t)p;
+    double frac = p - (double)i;
+    const float *base = x + i;
+    float sum = 0.0f;
+    float norm = 0.0f;
+    for (int j = 1 - reach; j <= reach; j++) {
+      double d = fabs((double)j - frac) * scale;
+      size_t at = (size_t)d;
+      if (at >= (size_t)half * SINC_PHASES) {
+        continue;
+      }
+      float w =
+          curve[at] + (curve[at + 1] - curve[at]) * (float)(d - (double)at);
+      sum += base[j] * w;
+      norm += w;
+    }
+    // Unity gain at DC whatever the phase
+    out[k] = sum / norm * gain;
+  }
+}
+
+// out[k] = x(pos + k * rate) * gain, k < n, interpolated with `interp`. Every
+// tap in the reach of the kernel at `rate`, see `dsp_reach`, must be
+// readable.
+static void dsp_resample(Interpolation interp, float *out, const float *x,
+                         double pos, double rate, float gain, size_t n) {
+  switch (interp) {
+  case INTERP_LINEAR:
+    dsp_resample_linear(out, x, pos, rate, gain, n);
+    break;
+  case INTERP_CUBIC:
+    dsp_resample_cubic(out, x, pos, rate, gain, n);
+    break;
+  case INTERP_SINC:
+    if (rate > 1.0) {
+      dsp_resample_sinc_curve(sinc_curve, SINC_TAPS / 2, rate, out, x, pos,
+                              rate, gain, n);
+    } else {
+      dsp_resample_sinc(out, x, pos, rate, gain, n);
+    }
+    break;
+  }
+}
+
+// First half of a periodic Hann window of length 2 * n. The second half is
+// `1 - w`, which is what makes 50% overlap-add sum to one.
+static void dsp_hann_rise(float *w, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    double s = sin(M_PI * 0.5 * (double)i / (double)n);
+    w[i] = (float)(s * s);
+  }
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef MBAS_ENCODING_C
+#define MBAS_ENCODING_C
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsp.c"
+
+// Compact in-memory encodings of the sample, decoded a few frames at a time
+// by the render loop.
+
+// int16
+
+typedef int16_t v4s16 __attribute__((vector_size(8)));
+
+static inline int16_t s16_from_float(float x) {
+  float scaled = x * 32767.0f;
+  if (scaled > 32767.0f) {
+    return 32767;
+  }
+  if (scaled < -32767.0f) {
+    return -32767;
+  }
+  return (int16_t)lrintf(scaled);
+}
+
+void encode_s16(int16_t *out, const float *x, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = s16_from_float(x[i]);
+  }
+}
+
+// out[i] = x[i] / 32767. RT-safe.
+static inline void decode_s16(float *out, const int16_t *x, size_t n) {
+  v4f scale = v4f_splat(1.0f / 32767.0f);
+  size_t vn = n & ~(size_t)3;
+  for (size_t i = 0; i < vn; i += 4) {
+    v4s16 s;
+    memcpy(&s, x + i, sizeof(s));
+    v4f_store(out + i, __builtin_convertvector(s, v4f) * scale);
+  }
+  for (size_t i = vn; i < n; i++) {
+    out[i] = (float)x[i] * (1.0f / 32767.0f);
+  }
+}
+
+// IMA ADPCM, 4 bits per frame.
+//
+// The sample is split in blocks of `ADPCM_BLOCK` frames that start from the
+// decoder state stored in their header, so any frame can be reached by
+// decoding at most one block.
+#define ADPCM_BLOCK 64
+
+struct adpcm_block {
+  int16_t predictor;
+  uint8_t index;
+  uint8_t reserved;
+  // Two frames per byte, low nibble first
+  uint8_t nibbles[ADPCM_BLOCK / 2];
+};
+
+typedef struct adpcm_block adpcm_block;
+
+static const int8_t ADPCM_INDEX[16] = {-1, -1, -1, -1, 2, 4, 6, 8,
+                                       -1, -1, -1, -1, 2, 4, 6, 8};
+
+static const int16_t ADPCM_STEP[89] = {
+    7,     8,     9,     10,    11,    12,    13,    14,    16,    17,
+    19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+    50,    55,    60,    66,    73,    80,    88,    97,    107,   118,
+    130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+    337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+    876,   963,   1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+    2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+    5894,  6484,  7132,  7845,  8630,  9493,  10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+
+// Applies `nibble` to the decoder state. Shared by the encoder so both stay
+// in step.
+static inline void adpcm_step(int *predictor, int *index, uint8_t nibble) {
+  int step = ADPCM_STEP[*index];
+  int diff = step >> 3;
+  if (nibble & 4) {
+    diff += step;
+  }
+  if (nibble & 2) {
+    diff += step >> 1;
+  }
+  if (nibble & 1) {
+    diff += step >> 2;
+  }
+  *predictor += (nibble & 8) ? -diff : diff;
+  *predictor = *predictor > 32767 ? 32767 : *predictor;
+  *predictor = *predictor < -32768 ? -32768 : *predictor;
+  *index += ADPCM_INDEX[nibble];
+  *index = *index > 88 ? 88 : *index;
+  *index = *index < 0 ? 0 : *index;
+}
+
+static inline size_t adpcm_blocks(size_t frames) {
+  return (frames + ADPCM_BLOCK - 1) / ADPCM_BLOCK;
+}
+
+void encode_adpcm(adpcm_block *out, const float *x, size_t n) {
+  // Start from the first frame, with a step size that fits the first change,
+  // instead of ramping up from silence
+  int predictor = n > 0 ? s16_from_float(x[0]) : 0;
+  int index = 0;
+  if (n > 1) {
+    int diff = abs(s16_from_float(x[1]) - predictor);
+    while (index < 88 && ADPCM_STEP[index] < diff) {
+      index++;
+    }
+  }
+
+  for (size_t b = 0; b < adpcm_blocks(n); b++) {
+    adpcm_block *block = &out[b];
+    block->predictor = (int16_t)predictor;
+    block->index = (uint8_t)index;
+    block->reserved = 0;
+    memset(block->nibbles, 0, sizeof(block->nibbles));
+
+    for (size_t i = 0; i < ADPCM_BLOCK && b * ADPCM_BLOCK + i < n; i++) {
+      int diff = s16_from_float(x[b * ADPCM_BLOCK + i]) - predictor;
+      int step = ADPCM_STEP[index];
+      uint8_t nibble = 0;
+      if (diff < 0) {
+        nibble = 8;
+        diff = -diff;
+      }
+      if (diff >= step) {
+        nibble |= 4;
+        diff -= step;
+      }
+      if (diff >= step >> 1) {
+        nibble |= 2;
+        diff -= step >> 1;
+      }
+      if (diff >= step >> 2) {
+        nibble |= 1;
+      }
+
+      block->nibbles[i / 2] |= (uint8_t)(nibble << (4 * (i & 1)));
+      adpcm_step(&predictor, &index, nibble);
+    }
+  }
+}
+
+// Decodes frames [from, from + n). RT-safe.
+static inline void decode_adpcm(float *out, const adpcm_block *blocks,
+                                size_t from, size_t n) {
+  size_t b = from / ADPCM_BLOCK;
+  size_t skip = from % ADPCM_BLOCK;
+
+  while (n > 0) {
+    const adpcm_block *block = &blocks[b++];
+    int predictor = block->predictor;
+    int index = block->index;
+    size_t end = skip + n < ADPCM_BLOCK ? skip + n : ADPCM_BLOCK;
+
+    for (size_t i = 0; i < end; i++) {
+      adpcm_step(&predictor, &index,
+                 (block->nibbles[i / 2] >> (4 * (i & 1))) & 0xf);
+      if (i >= skip) {
+        *out++ = (float)predictor * (1.0f / 32767.0f);
+      }
+    }
+
+    n -= end - skip;
+    skip = 0;
+  }
+}
+
+#endif
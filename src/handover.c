@@ -0,0 +1,125 @@
+#ifndef MBAS_HANDOVER_C
+#define MBAS_HANDOVER_C
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "data.c"
+#include "queue.c"
+#include "ring.c"
+#include "voice.c"
+
+// State passed to the new binary on an upgrade, see `upgrade` in main.c.
+//
+// It is written to a memfd whose number is in the HANDOVER_ENV environment
+// variable. The fds it names are inherited across the exec.
+#define HANDOVER_ENV "MBAS_HANDOVER"
+#define HANDOVER_MAGIC 0x6d626173 // "mbas"
+#define HANDOVER_VERSION 5
+
+// Command ring handed over, see `command_ring`
+struct handover_ring {
+  int memfd;
+  int eventfd;
+  pid_t owner;
+};
+
+struct handover {
+  uint32_t magic;
+  uint32_t version;
+
+  int socket_fd;
+  // `fd` is -1 if the audio was not started, see `startup.lazy`
+  sample_image sample;
+
+  // Playback state, indices into the sequences of the previous process
+  size_t sequence;
+  size_t selected_sequence;
+  uint32_t order_pos;
+  size_t current_step;
+  bool playing;
+  voice voice;
+
+  // Open command rings, with the commands still waiting in them
+  uint32_t ring_count;
+  struct handover_ring rings[MAX_RINGS];
+
+  // PLAYs that were waiting in the trigger queue
+  uint32_t trigger_count;
+  trigger triggers[];
+};
+
+typedef struct handover handover;
+
+static inline size_t handover_size(uint32_t trigger_count) {
+  return sizeof(handover) + trigger_count * sizeof(trigger);
+}
+
+// Writes `h` to a new memfd. Returns it, or -1.
+static int handover_write(const handover *h) {
+  int fd = memfd_create("mbas-handover", 0);
+  if (fd < 0) {
+    perror("memfd_create");
+    return -1;
+  }
+
+  size_t size = handover_size(h->trigger_count);
+  if (pwrite(fd, h, size, 0) != (ssize_t)size) {
+    perror("write");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Reads the state left by the previous process if this one was started by an
+// upgrade. Returns NULL otherwise. The caller frees it.
+static handover *handover_read(void) {
+  const char *env = getenv(HANDOVER_ENV);
+  if (!env) {
+    return NULL;
+  }
+
+  int fd = (int)strtol(env, NULL, 10);
+  unsetenv(HANDOVER_ENV);
+
+  handover header;
+  handover *h = NULL;
+  if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+      header.magic != HANDOVER_MAGIC || header.version != HANDOVER_VERSION) {
+    fprintf(stderr, "Invalid state from the previous process\n");
+    goto close_fd;
+  }
+
+  size_t size = handover_size(header.trigger_count);
+  h = (handover *)malloc(size);
+  if (!h || pread(fd, h, size, 0) != (ssize_t)size) {
+    fprintf(stderr, "Failed to read the state of the previous process\n");
+    free(h);
+    h = NULL;
+  }
+
+close_fd:
+  close(fd);
+  return h;
+}
+
+// Frees `h` without taking over what it holds, closing the sample and the
+// command rings. The socket is left to the caller.
+static void handover_discard(handover *h) {
+  if (h->sample.fd >= 0) {
+    close(h->sample.fd);
+  }
+  for (uint32_t i = 0; i < h->ring_count && i < MAX_RINGS; i++) {
+    close(h->rings[i].memfd);
+    close(h->rings[i].eventfd);
+  }
+  free(h);
+}
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef MBAS_LABELS_C
+#define MBAS_LABELS_C
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Open addressing (linear probing) table from step labels to step indices.
+// Built once at load time, lookups never allocate.
+struct label_slot {
+  uint32_t hash;
+  // Step index + 1, 0 marks an empty slot
+  uint32_t step;
+};
+
+struct label_table {
+  struct label_slot *slots;
+  uint32_t mask;
+};
+
+typedef struct label_table label_table;
+
+// FNV-1a, folded to 32 bits
+static uint32_t label_hash(const char *key, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)key[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Builds the table for `labels[step]`, where steps without a label are NULL.
+// Returns false if a label is repeated, setting `*duplicate` to its step, or
+// if out of memory, setting `*duplicate` to SIZE_MAX.
+bool label_table_build(label_table *table, char *const *labels, size_t n,
+                       size_t *duplicate) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    count += labels[i] != NULL;
+  }
+
+  // Keep the load factor at or below 1/2
+  uint32_t capacity = 2;
+  while (capacity < 2 * count) {
+    capacity <<= 1;
+  }
+
+  table->slots = (struct label_slot *)calloc(capacity, sizeof(*table->slots));
+  if (!table->slots) {
+    *duplicate = SIZE_MAX;
+    return false;
+  }
+  table->mask = capacity - 1;
+
+  for (size_t step = 0; step < n; step++) {
+    if (!labels[step]) {
+      continue;
+    }
+
+    uint32_t hash = label_hash(labels[step], strlen(labels[step]));
+    uint32_t i = hash & table->mask;
+    while (table->slots[i].step != 0) {
+      if (table->slots[i].hash == hash &&
+          strcmp(labels[table->slots[i].step - 1], labels[step]) == 0) {
+        *duplicate = step;
+        free(table->slots);
+        table->slots = NULL;
+        return false;
+      }
+      i = (i + 1) & table->mask;
+    }
+    table->slots[i].hash = hash;
+    table->slots[i].step = (uint32_t)step + 1;
+  }
+
+  return true;
+}
+
+// Step with label `key`, or SIZE_MAX if there is none.
+size_t label_table_find(const label_table *table, char *const *labels,
+                        const char *key) {
+  if (!table->slots) {
+    return SIZE_MAX;
+  }
+
+  uint32_t hash = label_hash(key, strlen(key));
+  for (uint32_t i = hash & table->mask; table->slots[i].step != 0;
+       i = (i + 1) & table->mask) {
+    struct label_slot slot = table->slots[i];
+    if (slot.hash == hash && strcmp(labels[slot.step - 1], key) == 0) {
+      return slot.step - 1;
+    }
+  }
+
+  return SIZE_MAX;
+}
+
+void label_table_free(label_table *table) {
+  free(table->slots);
+  table->slots = NULL;
+}
+
+#endif
@@ -1,10 +1,16 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <arpa/inet.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
 #include <unistd.h>
 
@@ -14,44 +20,501 @@
 
 #include "config.c"
 #include "data.c"
+#include "handover.c"
+#include "order.c"
+#include "osc.c"
+#include "queue.c"
+#include "ring.c"
+#include "state.c"
+#include "uring.c"
+#include "voice.c"
 #include "pipewire/stream.h"
 #include "spa/param/audio/raw.h"
 
 const char *const SOCKET_PATH = "/tmp/mbas.sock";
 
 const char *const PLAY_COMMAND = "PLAY";
+const char *const STATUS_COMMAND = "STATUS";
+const char *const LATENCY_COMMAND = "LATENCY";
+const char *const SELECT_COMMAND = "SELECT";
+const char *const RING_COMMAND = "RING";
+const char *const UNRING_COMMAND = "UNRING";
 
 const int DEFAULT_RATE = 44100;
 const int DEFAULT_CHANNELS = 1;
 
+// Frames rendered at once when mixing the fading voice
+#define SCRATCH_FRAMES 1024
+
+// PLAYs further apart than this restart the trigger rate estimate
+const int64_t MAX_TRIGGER_GAP_NS = 2000000000;
+
+// `pending_sequence` when no SELECT is waiting
+#define NO_SEQUENCE SIZE_MAX
+
 struct event_loop_data {
   struct pw_main_loop *loop;
   struct pw_stream *stream;
 
+  trigger_queue queue;
+
+  // Steps are relative to the active sequence
+  const Sequence *sequence;
+  order *order;
+  // Written by `on_process`, read by the main loop too
+  _Atomic bool playing;
   size_t current_step;
-  size_t current_step_pos;
-  bool play_next;
+
+  // Playback order of each sequence. Exhausted blocks are regenerated by
+  // `on_order_exhausted`.
+  order *orders;
+  struct spa_source *order_event;
+
+  // Sequence to switch to at the next step boundary, see `start_next_step`
+  _Atomic size_t pending_sequence;
+  // Last sequence selected. Written by the main loop, read by `on_process`
+  // too.
+  _Atomic size_t selected_sequence;
+
+  voice voices[2];
+  voice *voice;
+  float scratch[SCRATCH_FRAMES];
+
+  // Catch-up, see `catch_up`
+  uint32_t catch_up_threshold;
+  uint32_t fade_len;
+  uint32_t fade_left;
+  voice *fade;
+  _Atomic uint64_t skipped;
+
+  // Time-stretch, see `update_trigger_interval`
+  bool stretch;
+  double stretch_smoothing;
+  double stretch_max_ratio;
+  double trigger_interval_avg;
+  int64_t last_trigger_ns;
+  _Atomic uint32_t trigger_interval;
+
+  float velocity_curve[MAX_VELOCITY + 1];
+
+  // The data and the stream are set up by `start_audio`, at startup or with
+  // `startup.lazy` on the first command that needs them
+  const Config *config;
+  bool audio_started;
+  bool failed;
+
+  // Idle release, see `on_idle`
+  struct spa_source *idle_timer;
+  bool released;
+  // Set by `wake` and cleared by the first `on_process` after it, which
+  // stores the time in between in `wake_ns`
+  _Atomic int64_t wake_started_ns;
+  _Atomic int64_t wake_ns;
+
+  // Upgrade, see `upgrade`
+  int sockfd;
+  char **argv;
+  // State from the process this one replaced. NULL once used.
+  handover *inherited;
+  bool resumed;
+
+  // Position kept across restarts, see `state.path`
+  persistent_state state;
+
+  // Shared memory command rings, see `open_ring`. Their PLAYs are queued in
+  // `ring_queue`, which only `on_process` uses.
+  command_ring rings[MAX_RINGS];
+  struct spa_source *ring_wake_sources[MAX_RINGS];
+  struct spa_source *ring_owner_sources[MAX_RINGS];
+  struct spa_source *ring_event;
+  trigger_queue ring_queue;
+  // Incremented by `on_process` on entry and on exit, so odd while it runs
+  _Atomic uint64_t process_epoch;
+
+  // When the end of the step being played is heard and how long it is, in
+  // CLOCK_MONOTONIC nanoseconds, set by `on_process` for `queue_play`
+  _Atomic int64_t step_end_ns;
+  _Atomic int64_t step_ns;
+  // From a frame being written by `on_process` until it is heard, see
+  // `update_latency`
+  _Atomic int64_t latency_ns;
+
+#ifdef MBAS_WITH_IO_URING
+  // Receive of the command socket, see `on_uring`. NULL when it is read by
+  // `on_msg` instead.
+  datagram_uring uring;
+  struct spa_source *uring_source;
+#endif
 
   Data data;
 };
 
 typedef struct event_loop_data event_loop_data;
 
+static inline bool is_playing(const event_loop_data *data) {
+  return atomic_load_explicit(&data->playing, memory_order_relaxed);
+}
+
+static inline void set_playing(event_loop_data *data, bool playing) {
+  atomic_store_explicit(&data->playing, playing, memory_order_relaxed);
+}
+
+static inline size_t selected(event_loop_data *data) {
+  return atomic_load_explicit(&data->selected_sequence, memory_order_relaxed);
+}
+
+static inline void set_selected(event_loop_data *data, size_t sequence) {
+  atomic_store_explicit(&data->selected_sequence, sequence,
+                        memory_order_relaxed);
+}
+
 void init_event_loop_data(event_loop_data *data) {
-  data->current_step = data->data.step_sequence_length;
-  data->play_next = false;
+  atomic_init(&data->playing, false);
+  data->sequence = &data->data.sequences[0];
+  data->order = &data->orders[0];
+  data->current_step = 0;
+  atomic_init(&data->pending_sequence, NO_SEQUENCE);
+  atomic_init(&data->selected_sequence, 0);
+  data->voice = &data->voices[0];
+  data->fade = &data->voices[1];
+  data->fade_left = 0;
+  atomic_init(&data->skipped, 0);
+  data->trigger_interval_avg = 0.0;
+  data->last_trigger_ns = 0;
+  atomic_init(&data->trigger_interval, 0);
+  atomic_init(&data->step_end_ns, 0);
+  atomic_init(&data->step_ns, 0);
+  atomic_init(&data->latency_ns, 0);
+}
+
+// Duration of `frames` at DEFAULT_RATE
+static inline int64_t frames_ns(size_t frames) {
+  return (int64_t)frames * 1000000000 / DEFAULT_RATE;
+}
+
+static inline int64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Whether `at_ns` is a valid `PLAY at=`: 0, or a time at most
+// MAX_AT_AHEAD_NS past the earliest a PLAY can be heard. RT-safe.
+static bool valid_at(event_loop_data *data, int64_t at_ns) {
+  int64_t latency =
+      atomic_load_explicit(&data->latency_ns, memory_order_relaxed);
+  return at_ns >= 0 && at_ns <= monotonic_ns() + latency + MAX_AT_AHEAD_NS;
+}
+
+// (Re)starts the countdown to `on_idle`, or stops it if `idle` is false.
+static void set_idle_timer(event_loop_data *data, bool idle) {
+  if (!data->idle_timer) {
+    return;
+  }
+
+  struct timespec timeout = {0};
+  if (idle) {
+    timeout.tv_sec = data->config->idle.timeout_s;
+  }
+  pw_loop_update_timer(pw_main_loop_get_loop(data->loop), data->idle_timer,
+                       &timeout, NULL, false);
+}
+
+// Lets the clients of every ring post without waking the main loop, as
+// `on_process` polls the rings.
+static void rings_wake(event_loop_data *data) {
+  for (size_t i = 0; i < MAX_RINGS; i++) {
+    if (atomic_load(&data->rings[i].state) == RING_ACTIVE) {
+      command_ring_wake(&data->rings[i]);
+    }
+  }
+}
+
+// How much to stretch a step `length` frames long so that it fills the time
+// between PLAYs.
+static double step_ratio(event_loop_data *data, size_t length) {
+  if (!data->stretch) {
+    return 1.0;
+  }
+
+  uint32_t interval =
+      atomic_load_explicit(&data->trigger_interval, memory_order_relaxed);
+  if (interval == 0 || length < STRETCH_WINDOW) {
+    return 1.0;
+  }
+
+  double ratio = (double)interval / (double)length;
+  return SPA_CLAMP(ratio, 1.0 / data->stretch_max_ratio,
+                   data->stretch_max_ratio);
+}
+
+// Next step of the active order. RT-safe.
+static size_t next_step(event_loop_data *data) {
+  bool exhausted = false;
+  size_t step = order_next(data->order, &exhausted);
+  if (exhausted) {
+    pw_loop_signal_event(pw_main_loop_get_loop(data->loop), data->order_event);
+  }
+  return step;
+}
+
+// Sequence `t` jumps into when it is not the active one, because a SELECT
+// took effect after the jump was resolved, or NULL. RT-safe.
+static const Sequence *jump_sequence(event_loop_data *data, const trigger *t) {
+  if (t->step == TRIGGER_NEXT_STEP ||
+      t->sequence >= data->data.sequence_count) {
+    return NULL;
+  }
+  const Sequence *sequence = &data->data.sequences[t->sequence];
+  return sequence != data->sequence && t->step < sequence->length ? sequence
+                                                                  : NULL;
+}
+
+// Moves the active order past the step `t` plays. RT-safe.
+static size_t advance(event_loop_data *data, const trigger *t) {
+  // Steps past the end, from a binary PLAY, play the next step instead
+  if (t->step != TRIGGER_NEXT_STEP && t->step < data->sequence->length) {
+    if (!order_seek(data->order, (uint32_t)t->step)) {
+      return t->step;
+    }
+  } else {
+    for (uint32_t i = 0; i < t->skip; i++) {
+      next_step(data);
+    }
+  }
+  return next_step(data);
+}
+
+// Turns a binary PLAY, posted to a ring or sent to the socket, into a trigger,
+// checking it like `parse_play_args` does. Returns false if it is invalid.
+// RT-safe.
+static bool command_trigger(event_loop_data *data,
+                            const struct mbas_command *c, trigger *t) {
+  if (c->type != MBAS_COMMAND_PLAY || !(c->rate >= MIN_PLAYBACK_RATE) ||
+      !(c->rate <= MAX_PLAYBACK_RATE) || !(c->gain >= 0.0f) ||
+      !(c->gain <= MAX_GAIN) ||
+      (c->velocity > MAX_VELOCITY && c->velocity != MBAS_NO_VELOCITY) ||
+      !valid_at(data, c->at_ns)) {
+    return false;
+  }
+
+  t->step = c->step == MBAS_NEXT_STEP ? TRIGGER_NEXT_STEP : c->step;
+  t->sequence = selected(data);
+  t->skip = 0;
+  t->rate = c->rate;
+  t->gain = c->gain;
+  t->at_ns = c->at_ns;
+  if (c->velocity != MBAS_NO_VELOCITY) {
+    t->gain *= data->velocity_curve[c->velocity];
+  }
+  return true;
+}
+
+// Moves the PLAYs posted to the rings into `ring_queue`, where they go
+// through `queue.depth` and `queue.overflow` like the ones from the socket.
+// Acknowledges rings being closed. RT-safe.
+static void poll_rings(event_loop_data *data) {
+  for (size_t i = 0; i < MAX_RINGS; i++) {
+    command_ring *r = &data->rings[i];
+    int state = atomic_load(&r->state);
+
+    // Unless `close_ring` saw this run was not started and freed it already
+    if (state == RING_CLOSING &&
+        atomic_compare_exchange_strong(&r->state, &state, RING_CLOSED)) {
+      pw_loop_signal_event(pw_main_loop_get_loop(data->loop),
+                           data->ring_event);
+    }
+    if (state != RING_ACTIVE) {
+      continue;
+    }
+
+    struct mbas_command c;
+    while (command_ring_pop(r, &c)) {
+      trigger t;
+      if (command_trigger(data, &c, &t)) {
+        trigger_queue_push(&data->ring_queue, &t);
+      }
+    }
+  }
+}
+
+// Triggers waiting in either queue
+static uint32_t pending_triggers(event_loop_data *data) {
+  return trigger_queue_pending(&data->queue) +
+         trigger_queue_pending(&data->ring_queue);
+}
+
+// Pops the next trigger, from the socket first. RT-safe.
+static bool pop_trigger(event_loop_data *data, trigger *t) {
+  return trigger_queue_pop(&data->queue, t) ||
+         trigger_queue_pop(&data->ring_queue, t);
+}
+
+// Frames to wait from the output frame heard at `out_ns` until the next
+// trigger is due, 0 if it is due or there is none. RT-safe.
+static uint32_t frames_until_due(event_loop_data *data, int64_t out_ns) {
+  trigger t;
+  if (!(trigger_queue_peek(&data->queue, &t) ||
+        trigger_queue_peek(&data->ring_queue, &t)) ||
+      t.at_ns <= out_ns) {
+    return 0;
+  }
+
+  // Seconds first, so this does not overflow however far ahead it is
+  int64_t ns = t.at_ns - out_ns;
+  int64_t frames = ns / 1000000000 * DEFAULT_RATE +
+                   ns % 1000000000 * DEFAULT_RATE / 1000000000;
+  return frames > UINT32_MAX ? UINT32_MAX : (uint32_t)frames;
+}
+
+// Pops the next trigger and moves to its step, switching sequence first if a
+// SELECT is waiting. RT-safe.
+static bool start_next_step(event_loop_data *data) {
+  trigger t;
+  if (!pop_trigger(data, &t)) {
+    return false;
+  }
+
+  size_t select = atomic_exchange_explicit(&data->pending_sequence,
+                                           NO_SEQUENCE, memory_order_acquire);
+  if (select != NO_SEQUENCE) {
+    data->sequence = &data->data.sequences[select];
+    data->order = &data->orders[select];
+    order_rewind(data->order);
+  }
+
+  // A jump into the previous sequence plays its step without moving the
+  // order of the new one
+  size_t step;
+  const Sequence *jump = jump_sequence(data, &t);
+  if (jump) {
+    step = jump->first + t.step;
+  } else {
+    data->current_step = advance(data, &t);
+    state_store(&data->state, (size_t)(data->sequence - data->data.sequences),
+                data->current_step);
+    step = data->sequence->first + data->current_step;
+  }
+
+  size_t start = data->data.step_sequence_l[step];
+  size_t end = data->data.step_sequence_r[step];
+  double rate =
+      SPA_CLAMP((double)data->data.step_sequence_rate[step] * t.rate,
+                MIN_PLAYBACK_RATE, MAX_PLAYBACK_RATE);
+  voice_start(data->voice, start, end, rate, t.gain,
+              step_ratio(data, voice_length(start, end, rate)));
+  set_playing(data, true);
+  return true;
+}
+
+// When more than `catch_up_threshold` triggers are waiting, jumps straight to
+// the step of the newest one instead of playing every step in between. The
+// step being played is faded out over `fade_len` frames. RT-safe.
+static void catch_up(event_loop_data *data) {
+  if (data->catch_up_threshold == 0) {
+    return;
+  }
+
+  uint32_t pending = pending_triggers(data);
+  if (pending <= data->catch_up_threshold) {
+    return;
+  }
+
+  uint64_t skipped = 0;
+  trigger t;
+  for (uint32_t i = 0; i + 1 < pending; i++) {
+    if (!pop_trigger(data, &t)) {
+      break;
+    }
+    if (!jump_sequence(data, &t)) {
+      advance(data, &t);
+    }
+    // A jump moves the order rather than stepping it
+    if (t.step == TRIGGER_NEXT_STEP) {
+      skipped += t.skip + 1;
+    }
+  }
+  atomic_fetch_add_explicit(&data->skipped, skipped, memory_order_relaxed);
+
+  if (is_playing(data) && data->fade_len > 0) {
+    voice *fade = data->fade;
+    data->fade = data->voice;
+    data->voice = fade;
+    data->fade_left = data->fade_len;
+  }
+
+  // The newest trigger is popped by `start_next_step`
+  set_playing(data, false);
+}
+
+// Crossfades the step faded out by `catch_up` into `out`. RT-safe.
+static void mix_fade(event_loop_data *data, float *out, uint32_t n_frames) {
+  uint32_t frames = SPA_MIN(data->fade_left, n_frames);
+  float step = 1.0f / (float)data->fade_len;
+  float gain = (float)(data->fade_len - data->fade_left) * step;
+
+  for (uint32_t done = 0; done < frames;) {
+    uint32_t chunk = SPA_MIN(frames - done, SCRATCH_FRAMES);
+    uint32_t rendered =
+        voice_render(data->fade, &data->data, data->scratch, chunk);
+    memset(data->scratch + rendered, 0, (chunk - rendered) * sizeof(float));
+
+    for (uint32_t i = 0; i < chunk; i++) {
+      out[done + i] = out[done + i] * gain + data->scratch[i] * (1.0f - gain);
+      gain += step;
+    }
+    done += chunk;
+  }
+
+  data->fade_left -= frames;
+}
+
+// Has the clients of every ring write to its eventfd after posting, since
+// `on_process` stops polling. Returns false, leaving them all awake, if a
+// command was posted meanwhile.
+static bool rings_sleep(event_loop_data *data) {
+  for (size_t i = 0; i < MAX_RINGS; i++) {
+    command_ring *r = &data->rings[i];
+    if (atomic_load(&r->state) == RING_ACTIVE && !command_ring_sleep(r)) {
+      rings_wake(data);
+      return false;
+    }
+  }
+  return true;
 }
 
 static int stop_stream(struct spa_loop *loop, bool async, uint32_t seq,
                        const void *_data, size_t size, void *userdata) {
   event_loop_data *d = userdata;
+
+  // A PLAY may have arrived after `on_process` found the queue empty
+  if (pending_triggers(d) > 0 || !rings_sleep(d)) {
+    return 0;
+  }
+
   pw_stream_set_active(d->stream, false);
+  set_idle_timer(d, true);
 
   return 0;
 }
 
+// Output latency: the buffer being written, then whatever the resampler
+// holds and the delay of the graph and the device. RT-safe.
+static int64_t update_latency(event_loop_data *data, uint32_t n_frames) {
+  int64_t latency = frames_ns(n_frames);
+  struct pw_time time;
+  if (pw_stream_get_time_n(data->stream, &time, sizeof(time)) == 0 &&
+      time.rate.denom > 0) {
+    latency += time.delay * 1000000000 * time.rate.num / time.rate.denom +
+               frames_ns(time.buffered);
+  }
+  atomic_store_explicit(&data->latency_ns, latency, memory_order_relaxed);
+  return latency;
+}
+
 void on_process(void *userdata) {
   bool should_stop = false;
+  bool waiting = false;
   event_loop_data *data = userdata;
 
   struct pw_buffer *b;
@@ -63,6 +526,16 @@ void on_process(void *userdata) {
     pw_log_warn("out of buffers: %m");
     return;
   }
+  int64_t now = monotonic_ns();
+
+  // First buffer since `wake`
+  int64_t wake_started =
+      atomic_load_explicit(&data->wake_started_ns, memory_order_relaxed);
+  if (wake_started != 0) {
+    atomic_store_explicit(&data->wake_ns, now - wake_started,
+                          memory_order_relaxed);
+    atomic_store_explicit(&data->wake_started_ns, 0, memory_order_relaxed);
+  }
 
   buf = b->buffer;
   if ((p = buf->datas[0].data) == NULL)
@@ -74,47 +547,41 @@ void on_process(void *userdata) {
     n_frames = SPA_MIN((int)b->requested, n_frames);
 
   pending_frames = n_frames;
+  int64_t latency = update_latency(data, n_frames);
 
-  if (data->current_step == data->data.step_sequence_length) {
-    if (data->play_next) {
-      data->current_step = 0;
-      data->current_step_pos = data->data.step_sequence_l[0];
-      data->play_next = false;
-    } else {
-      data->current_step = 0;
-      data->current_step_pos = data->data.step_sequence_r[0];
-    }
-  }
-
-  while (pending_frames > 0 &&
-         (data->current_step_pos <
-              data->data.step_sequence_r[data->current_step] ||
-          data->play_next)) {
-    size_t available_frames =
-        data->data.step_sequence_r[data->current_step] - data->current_step_pos;
-    size_t copy_frames = SPA_MIN(available_frames, pending_frames);
-
-    memcpy(p + (n_frames - pending_frames) * stride,
-           &data->data.sample[data->current_step_pos], copy_frames * stride);
+  atomic_fetch_add(&data->process_epoch, 1);
+  poll_rings(data);
+  catch_up(data);
 
-    pending_frames -= copy_frames;
-    data->current_step_pos += copy_frames;
-
-    if (data->current_step_pos ==
-        data->data.step_sequence_r[data->current_step]) {
-      if (!data->play_next) {
-        data->current_step = data->data.step_sequence_length;
-        should_stop = true;
+  while (pending_frames > 0) {
+    if (!is_playing(data)) {
+      // A PLAY with `at=` waits in silence until it is due
+      int64_t out_ns = now + latency + frames_ns(n_frames - pending_frames);
+      uint32_t wait = frames_until_due(data, out_ns);
+      if (wait >= pending_frames) {
+        waiting = true;
         break;
       }
-      if (data->current_step == data->data.step_sequence_length - 1) {
-        data->current_step = 0;
-        data->current_step_pos = data->data.step_sequence_l[0];
-      } else {
-        data->current_step = data->current_step + 1;
-        data->current_step_pos = data->data.step_sequence_l[data->current_step];
+      memset(p + (n_frames - pending_frames) * stride, 0, wait * stride);
+      pending_frames -= wait;
+
+      if (!start_next_step(data)) {
+        break;
       }
-      data->play_next = false;
+      int64_t start_ns = out_ns + frames_ns(wait);
+      int64_t length_ns = frames_ns(data->voice->left);
+      atomic_store_explicit(&data->step_ns, length_ns, memory_order_relaxed);
+      atomic_store_explicit(&data->step_end_ns, start_ns + length_ns,
+                            memory_order_relaxed);
+    }
+
+    pending_frames -=
+        voice_render(data->voice, &data->data,
+                     (float *)(p + (n_frames - pending_frames) * stride),
+                     pending_frames);
+
+    if (voice_done(data->voice)) {
+      set_playing(data, false);
     }
   }
 
@@ -124,11 +591,18 @@ void on_process(void *userdata) {
            pending_frames * stride);
   }
 
+  if (data->fade_left > 0) {
+    mix_fade(data, (float *)p, n_frames);
+  }
+
+  should_stop = !is_playing(data) && data->fade_left == 0 && !waiting;
+
   buf->datas[0].chunk->offset = 0;
   buf->datas[0].chunk->stride = stride;
   buf->datas[0].chunk->size = n_frames * stride;
 
   pw_stream_queue_buffer(data->stream, b);
+  atomic_fetch_add(&data->process_epoch, 1);
 
   if (should_stop) {
     pw_loop_invoke(pw_main_loop_get_loop(data->loop), stop_stream, 0, NULL, 0,
@@ -136,27 +610,39 @@ void on_process(void *userdata) {
   }
 }
 
-void on_msg(void *userdata, int fd, uint32_t mask) {
-  event_loop_data *data = userdata;
-  char buffer[256];
-  ssize_t n = recv(fd, buffer, sizeof(buffer) - 1, 0);
-
-  if (n < 0) {
-    perror("recv");
-    return;
-  }
+// Milliseconds since `start`, and moves `start` to now
+static double lap_ms(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double ms = (double)(now.tv_sec - start->tv_sec) * 1e3 +
+              (double)(now.tv_nsec - start->tv_nsec) / 1e6;
+  *start = now;
+  return ms;
+}
 
-  buffer[n] = '\0';
-  if (strncmp(buffer, PLAY_COMMAND, 4) == 0) {
-    // Start playback
-    printf("Received PLAY command\n");
-    int res = pw_stream_set_active(data->stream, true);
-    data->play_next = true;
-  } else {
-    fprintf(stderr, "Unknown command received: %s\n", buffer);
-  }
+// Loads the sample and the step sequences on its own thread, while the main
+// one sets up PipeWire.
+struct data_loader {
+  const Config *config;
+  // Sample of the process this one replaced, if any
+  const sample_image *image;
+  Data data;
+  bool ok;
+  bool inherited;
+  double ms;
+};
 
-  return;
+static void *load_data(void *userdata) {
+  struct data_loader *loader = userdata;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  loader->inherited = loader->image &&
+                      data_from_image(loader->config, loader->image,
+                                      &loader->data);
+  loader->ok = loader->inherited ||
+               data_from_config(loader->config, &loader->data);
+  loader->ms = lap_ms(&start);
+  return NULL;
 }
 
 static const struct pw_stream_events stream_events = {
@@ -164,89 +650,32 @@ static const struct pw_stream_events stream_events = {
     .process = on_process,
 };
 
-static void do_quit(void *userdata, int signal_number) {
-  event_loop_data *data = userdata;
-  pw_main_loop_quit(data->loop);
-}
-
-int main() {
-  // Load configuration
-  Config config;
-  load_config_result_t res = load_config(&config);
-
-  if (res.code != LOAD_CONFIG_SUCCESS) {
-    fprintf(stderr, "Failed to load config: %s\n", res.errmsg);
-    free(res.errmsg);
-    return res.code;
-  }
-
-  // Initialize data from config
-  Data internal_data = data_from_config(&config);
-  free_config(&config);
-
-  // Setup UNIX domain socket server
-  int sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
-
-  if (sockfd < 0) {
-    perror("socket");
-    goto exit_failure;
-  }
-
-  struct sockaddr_un addr;
-  memset(&addr, 0, sizeof(struct sockaddr_un));
-
-  addr.sun_family = AF_UNIX;
-  strcpy(addr.sun_path, SOCKET_PATH);
-
-  unlink(SOCKET_PATH);
-
-  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-    perror("bind");
-    goto close_socket;
+// Carries on after the step the previous run was playing, see `state.path`
+static void restore_position(event_loop_data *data) {
+  size_t sequence, step;
+  if (!state_position(&data->state, &sequence, &step) ||
+      sequence >= data->data.sequence_count ||
+      step >= data->data.sequences[sequence].length) {
+    return;
   }
 
-  // Set socket to non-blocking
-  int flags = fcntl(sockfd, F_GETFL, 0);
-  if (flags == -1) {
-    perror("fcntl");
-    goto close_socket;
-  }
-  flags |= O_NONBLOCK;
-  if (fcntl(sockfd, F_SETFL, flags) == -1) {
-    perror("fcntl");
-    goto close_socket;
+  data->sequence = &data->data.sequences[sequence];
+  data->order = &data->orders[sequence];
+  set_selected(data, sequence);
+  if (order_seek(data->order, (uint32_t)step)) {
+    next_step(data);
   }
+  data->current_step = step;
+  printf("Resuming after step %zu of %s\n", step, data->sequence->name);
+}
 
-  printf("Server is listening on %s\n", SOCKET_PATH);
-
-  // TODO: Make backend variable
-  // Initialize audio backend
-  event_loop_data data;
-  data.data = internal_data;
-  init_event_loop_data(&data);
-
+// Connects the stream, inactive. Returns false, after printing why, on
+// failure.
+static bool connect_stream(event_loop_data *data) {
   const struct spa_pod *params[1];
   uint8_t buffer[1024];
   struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 
-  pw_init(0, 0);
-
-  data.loop = pw_main_loop_new(0 /* properties */);
-
-  // Set handlers for SIGINT and SIGTERM to stop the main loop
-  pw_loop_add_signal(pw_main_loop_get_loop(data.loop), SIGINT, do_quit, &data);
-  pw_loop_add_signal(pw_main_loop_get_loop(data.loop), SIGTERM, do_quit, &data);
-
-  data.stream = pw_stream_new_simple(
-      pw_main_loop_get_loop(data.loop), "Music Box Audio Service",
-      pw_properties_new(
-          PW_KEY_MEDIA_TYPE, "Audio",        // Clearly we want to play audio
-          PW_KEY_MEDIA_CATEGORY, "Playback", // Simple playback stream
-          PW_KEY_MEDIA_ROLE, "Notification", // Original purpose
-          NULL                               // End of properties
-          ),
-      &stream_events, &data);
-
   /* Make one parameter with the supported formats. The SPA_PARAM_EnumFormat
    * id means that this is a format enumeration (of 1 value). */
   params[0] = spa_format_audio_raw_build(
@@ -257,7 +686,7 @@ int main() {
 
   /* Now connect this stream. We ask that our process function is
    * called in a realtime thread. */
-  int res_con = pw_stream_connect(data.stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+  int res_con = pw_stream_connect(data->stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
                                   PW_STREAM_FLAG_AUTOCONNECT |
                                       PW_STREAM_FLAG_MAP_BUFFERS |
                                       PW_STREAM_FLAG_INACTIVE,
@@ -265,31 +694,1494 @@ int main() {
 
   if (res_con < 0) {
     fprintf(stderr, "Failed to connect stream: %s\n", spa_strerror(res_con));
-    goto cleanup_backend;
+    return false;
   }
+  return true;
+}
 
-  // Register socket fd with the main loop
-  struct spa_source *source =
-      pw_loop_add_io(pw_main_loop_get_loop(data.loop), sockfd, SPA_IO_IN, false,
-                     on_msg, &data);
+// Loads the data and connects the stream. The data is loaded on its own
+// thread while PipeWire is set up. Returns false, after printing why, on
+// failure.
+static bool start_audio(event_loop_data *data) {
+  const Config *config = data->config;
+  struct timespec phase;
+  clock_gettime(CLOCK_MONOTONIC, &phase);
 
-  // Finally!!!
-  // Run the main loop
-  pw_main_loop_run(data.loop);
+  // Load the sample and the steps while PipeWire starts up
+  struct data_loader loader = {.config = config};
+  if (data->inherited && data->inherited->sample.fd >= 0) {
+    loader.image = &data->inherited->sample;
+  }
+  pthread_t loader_thread;
+  bool threaded = pthread_create(&loader_thread, NULL, load_data, &loader) == 0;
 
-  // Cleanup
-  pw_stream_destroy(data.stream);
-  pw_main_loop_destroy(data.loop);
-  pw_deinit();
-  close(sockfd);
-  return EXIT_SUCCESS;
+  if (!threaded) {
+    load_data(&loader);
+  }
 
-cleanup_backend:
-  pw_stream_destroy(data.stream);
-  pw_main_loop_destroy(data.loop);
-  pw_deinit();
-close_socket:
-  close(sockfd);
-exit_failure:
-  return EXIT_FAILURE;
+  data->stream = pw_stream_new_simple(
+      pw_main_loop_get_loop(data->loop), "Music Box Audio Service",
+      pw_properties_new(
+          PW_KEY_MEDIA_TYPE, "Audio",        // Clearly we want to play audio
+          PW_KEY_MEDIA_CATEGORY, "Playback", // Simple playback stream
+          PW_KEY_MEDIA_ROLE, "Notification", // Original purpose
+          NULL                               // End of properties
+          ),
+      &stream_events, data);
+
+  // The stream starts inactive, so `on_process` does not run before the data
+  // below is ready
+  bool connected = connect_stream(data);
+
+  double pipewire_ms = lap_ms(&phase);
+
+  // Wait for the data
+  if (threaded) {
+    pthread_join(loader_thread, NULL);
+  }
+
+  double wait_ms = lap_ms(&phase);
+
+  if (loader.image) {
+    close(data->inherited->sample.fd);
+    data->inherited->sample.fd = -1;
+  }
+  data->resumed = loader.inherited;
+
+  if (!connected || !loader.ok) {
+    return false;
+  }
+
+  data->data = loader.data;
+
+  uint64_t seed = config->order.seed;
+  if (seed == 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    seed = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+  data->orders = orders_create(&data->data, config->order.mode, seed);
+  if (!data->orders) {
+    fprintf(stderr, "Failed to allocate playback orders\n");
+    return false;
+  }
+
+  init_event_loop_data(data);
+  voice_init(config->playback.interpolation);
+  if (config->state.path[0] != '\0' &&
+      state_open(&data->state, config->state.path, &data->data)) {
+    restore_position(data);
+  }
+  data->audio_started = true;
+  set_idle_timer(data, true);
+
+  double playback_ms = lap_ms(&phase);
+  printf("Audio started in %.1f ms: data %.1f ms alongside pipewire %.1f ms "
+         "(waited %.1f ms), playback %.1f ms\n",
+         pipewire_ms + wait_ms + playback_ms, loader.ms, pipewire_ms, wait_ms,
+         playback_ms);
+  return true;
+}
+
+// Starts the audio for the first command that needs it with `startup.lazy`.
+// Quits if it cannot.
+static bool ensure_audio(event_loop_data *data) {
+  if (data->audio_started) {
+    return true;
+  }
+
+  printf("Starting audio on the first command\n");
+  if (!start_audio(data)) {
+    data->failed = true;
+    pw_main_loop_quit(data->loop);
+    return false;
+  }
+  return true;
+}
+
+// After `idle.timeout_s` without playing, lets the kernel reclaim the sample
+// and disconnects the stream until the next PLAY, see `wake`.
+static void on_idle(void *userdata, uint64_t expirations) {
+  event_loop_data *data = userdata;
+
+  if (data->released || is_playing(data) || data->fade_left > 0 ||
+      pending_triggers(data) > 0) {
+    return;
+  }
+
+  sample_release(&data->data, data->config->idle.release);
+  pw_stream_disconnect(data->stream);
+  data->released = true;
+  printf("Idle for %u s, released the sample and the stream\n",
+         data->config->idle.timeout_s);
+}
+
+// Step the PLAY `t` starts once the stream is back, see `start_next_step`
+static size_t wake_step(event_loop_data *data, const trigger *t) {
+  size_t select =
+      atomic_load_explicit(&data->pending_sequence, memory_order_relaxed);
+  const Sequence *sequence =
+      select != NO_SEQUENCE ? &data->data.sequences[select] : data->sequence;
+
+  if (t->step != TRIGGER_NEXT_STEP &&
+      t->sequence < data->data.sequence_count &&
+      t->step < data->data.sequences[t->sequence].length) {
+    return data->data.sequences[t->sequence].first + t->step;
+  }
+  if (select == NO_SEQUENCE) {
+    return sequence->first + order_peek(data->order);
+  }
+  // A pending SELECT restarts the order of its sequence
+  const order *o = &data->orders[select];
+  return sequence->first + o->blocks[o->current].steps[0];
+}
+
+// Undoes `on_idle` for the PLAY `t`: faults in the step it starts, only that
+// one, and reconnects the stream. The time until the first buffer is
+// reported by STATUS as `wake_ms`.
+static bool wake(event_loop_data *data, const trigger *t) {
+  int64_t started = monotonic_ns();
+  atomic_store_explicit(&data->wake_started_ns, started, memory_order_relaxed);
+
+  size_t step = wake_step(data, t);
+  sample_prefetch(&data->data, data->data.step_sequence_l[step],
+                  data->data.step_sequence_r[step]);
+  double prefetch_ms = (double)(monotonic_ns() - started) / 1e6;
+
+  if (!connect_stream(data)) {
+    return false;
+  }
+
+  data->released = false;
+  printf("Waking up: step prefetched in %.1f ms, stream reconnected in %.1f "
+         "ms\n",
+         prefetch_ms, (double)(monotonic_ns() - started) / 1e6 - prefetch_ms);
+  return true;
+}
+
+// Makes sure the stream runs to play `t`, waking it up from `on_idle` first
+// if needed. Quits if that fails.
+static bool resume_stream(event_loop_data *data, const trigger *t) {
+  set_idle_timer(data, false);
+  if (data->released && !wake(data, t)) {
+    data->failed = true;
+    pw_main_loop_quit(data->loop);
+    return false;
+  }
+  rings_wake(data);
+  pw_stream_set_active(data->stream, true);
+  return true;
+}
+
+// Path of the binary this process was started from. If it was replaced since,
+// the link reads "<path> (deleted)" and that is the new binary.
+static bool upgrade_path(char *path, size_t size) {
+  ssize_t len = readlink("/proc/self/exe", path, size - 1);
+  if (len < 0) {
+    perror("readlink");
+    return false;
+  }
+  path[len] = '\0';
+
+  const char *deleted = " (deleted)";
+  size_t deleted_len = strlen(deleted);
+  if ((size_t)len > deleted_len &&
+      strcmp(path + len - deleted_len, deleted) == 0) {
+    path[len - deleted_len] = '\0';
+  }
+  return true;
+}
+
+#ifdef MBAS_WITH_IO_URING
+static void stop_uring(event_loop_data *data);
+static void resume_uring(event_loop_data *data);
+#endif
+
+// On SIGUSR2, execs the binary at the path this one was started from, handing
+// it the socket, the command rings, the sample and the playback state, see
+// `handover`. PLAYs sent meanwhile wait in the socket and the rings. If
+// anything fails, carries on as before.
+static void upgrade(void *userdata, int signal_number) {
+  event_loop_data *data = userdata;
+  char path[4096];
+
+  if (!upgrade_path(path, sizeof(path))) {
+    return;
+  }
+  printf("Upgrading to %s\n", path);
+
+#ifdef MBAS_WITH_IO_URING
+  if (data->uring_source) {
+    stop_uring(data);
+  }
+#endif
+
+  // Both queues
+  uint32_t depth = 2 * data->queue.depth;
+  handover *h = (handover *)calloc(1, handover_size(depth));
+  if (!h) {
+    fprintf(stderr, "Failed to allocate upgrade state\n");
+    goto resume_receive;
+  }
+
+  h->magic = HANDOVER_MAGIC;
+  h->version = HANDOVER_VERSION;
+  h->socket_fd = data->sockfd;
+  h->sample.fd = -1;
+
+  int state_fd = -1;
+  if (data->audio_started) {
+    // Stops `on_process`, which owns the state read below
+    if (!data->released) {
+      pw_stream_disconnect(data->stream);
+    }
+
+    if (!sample_export(&data->data, &h->sample)) {
+      goto resume;
+    }
+
+    h->sequence = (size_t)(data->sequence - data->data.sequences);
+    h->selected_sequence = selected(data);
+    h->order_pos = data->order->pos;
+    h->current_step = data->current_step;
+    h->playing = is_playing(data);
+    h->voice = *data->voice;
+    while (h->trigger_count < depth &&
+           pop_trigger(data, &h->triggers[h->trigger_count])) {
+      h->trigger_count++;
+    }
+  }
+
+  // Nothing polls the rings until the new process does, so clients wake it
+  // up through the eventfd
+  for (size_t i = 0; i < MAX_RINGS; i++) {
+    command_ring *r = &data->rings[i];
+    if (atomic_load(&r->state) == RING_ACTIVE) {
+      atomic_store(&r->ring->sleeping, 1);
+      h->rings[h->ring_count++] = (struct handover_ring){
+          .memfd = r->memfd, .eventfd = r->eventfd, .owner = r->owner};
+    }
+  }
+
+  state_fd = handover_write(h);
+  if (state_fd < 0) {
+    goto resume;
+  }
+
+  char env[16];
+  snprintf(env, sizeof(env), "%d", state_fd);
+  setenv(HANDOVER_ENV, env, 1);
+  fcntl(data->sockfd, F_SETFD, 0);
+  for (uint32_t i = 0; i < h->ring_count; i++) {
+    fcntl(h->rings[i].memfd, F_SETFD, 0);
+    fcntl(h->rings[i].eventfd, F_SETFD, 0);
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  execv(path, data->argv);
+
+  perror("execv");
+  unsetenv(HANDOVER_ENV);
+  close(state_fd);
+
+resume:
+  fprintf(stderr, "Upgrade failed, carrying on\n");
+  if (h->sample.fd >= 0) {
+    close(h->sample.fd);
+  }
+  for (uint32_t i = 0; i < h->trigger_count; i++) {
+    trigger_queue_push(&data->queue, &h->triggers[i]);
+  }
+  if (data->audio_started && !data->released && connect_stream(data) &&
+      (is_playing(data) || h->trigger_count > 0)) {
+    pw_stream_set_active(data->stream, true);
+  }
+  free(h);
+resume_receive:
+#ifdef MBAS_WITH_IO_URING
+  if (data->uring_source) {
+    resume_uring(data);
+  }
+#endif
+  return;
+}
+
+// Picks up the playback where the process this one replaced left it. The
+// step being played carries on only if the sample is the same.
+static void resume_playback(event_loop_data *data, const handover *h) {
+  size_t count = data->data.sequence_count;
+  if (h->sequence < count &&
+      h->current_step < data->data.sequences[h->sequence].length) {
+    data->sequence = &data->data.sequences[h->sequence];
+    data->order = &data->orders[h->sequence];
+    set_selected(data, h->sequence);
+    data->current_step = h->current_step;
+    if (h->order_pos < data->order->blocks[data->order->current].length) {
+      data->order->pos = h->order_pos;
+    }
+  }
+  if (h->selected_sequence < count && h->selected_sequence != h->sequence) {
+    set_selected(data, h->selected_sequence);
+    atomic_store_explicit(&data->pending_sequence, h->selected_sequence,
+                          memory_order_release);
+  }
+
+  if (data->resumed && h->playing) {
+    data->voice = &data->voices[0];
+    data->fade = &data->voices[1];
+    *data->voice = h->voice;
+    set_playing(data, true);
+  }
+
+  for (uint32_t i = 0; i < h->trigger_count; i++) {
+    trigger_queue_push(&data->queue, &h->triggers[i]);
+  }
+
+  if (is_playing(data) || h->trigger_count > 0) {
+    set_idle_timer(data, false);
+    pw_stream_set_active(data->stream, true);
+  }
+
+  printf("Resumed at step %zu of %s%s, %u PLAYs queued\n", data->current_step,
+         data->sequence->name, is_playing(data) ? ", playing" : "",
+         h->trigger_count);
+}
+
+static const char *const OVERFLOW_NAMES[] = {
+    [OVERFLOW_DROP_NEWEST] = "drop_newest",
+    [OVERFLOW_DROP_OLDEST] = "drop_oldest",
+    [OVERFLOW_COALESCE] = "coalesce",
+};
+
+// Keeps a running average of the time between PLAYs, in frames, for
+// `step_ratio`.
+static void update_trigger_interval(event_loop_data *data) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  int64_t now = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  int64_t gap = now - data->last_trigger_ns;
+  data->last_trigger_ns = now;
+
+  if (gap > MAX_TRIGGER_GAP_NS) {
+    data->trigger_interval_avg = 0.0;
+  } else {
+    double interval = (double)gap * DEFAULT_RATE / 1e9;
+    if (data->trigger_interval_avg == 0.0) {
+      data->trigger_interval_avg = interval;
+    } else {
+      data->trigger_interval_avg +=
+          data->stretch_smoothing * (interval - data->trigger_interval_avg);
+    }
+  }
+
+  atomic_store_explicit(&data->trigger_interval,
+                        (uint32_t)data->trigger_interval_avg,
+                        memory_order_relaxed);
+}
+
+// Points `t` at the step of the selected sequence labelled `label`. Returns
+// false if there is none.
+static bool find_step(event_loop_data *data, const char *label, trigger *t) {
+  t->sequence = selected(data);
+  const Sequence *sequence = &data->data.sequences[t->sequence];
+  t->step = label_table_find(&sequence->labels,
+                             data->data.step_sequence_label + sequence->first,
+                             label);
+  return t->step != TRIGGER_NEXT_STEP;
+}
+
+// Parses the `key=value` arguments and the step label of a PLAY into `t`,
+// and `seq=` into `seq`. Returns false if any of them is invalid.
+static bool parse_play_args(event_loop_data *data, char *args, trigger *t,
+                            int64_t *seq) {
+  char *saveptr = NULL;
+  for (char *token = strtok_r(args, " \t\r\n", &saveptr); token;
+       token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+    if (strncmp(token, "seq=", 4) == 0) {
+      char *end;
+      unsigned long long value = strtoull(token + 4, &end, 10);
+      if (*end != '\0' || end == token + 4 || value > UINT32_MAX) {
+        return false;
+      }
+      *seq = (int64_t)value;
+    } else if (strncmp(token, "at=", 3) == 0) {
+      char *end;
+      long long at = strtoll(token + 3, &end, 10);
+      if (*end != '\0' || end == token + 3 || !valid_at(data, at)) {
+        return false;
+      }
+      t->at_ns = at;
+    } else if (strncmp(token, "rate=", 5) == 0) {
+      char *end;
+      double rate = strtod(token + 5, &end);
+      if (*end != '\0' || !(rate >= MIN_PLAYBACK_RATE) ||
+          !(rate <= MAX_PLAYBACK_RATE)) {
+        return false;
+      }
+      t->rate = (float)rate;
+    } else if (strncmp(token, "vel=", 4) == 0) {
+      char *end;
+      long velocity = strtol(token + 4, &end, 10);
+      if (*end != '\0' || velocity < 0 || velocity > MAX_VELOCITY) {
+        return false;
+      }
+      t->gain *= data->velocity_curve[velocity];
+    } else if (strncmp(token, "gain=", 5) == 0) {
+      char *end;
+      double gain = strtod(token + 5, &end);
+      if (*end != '\0' || !(gain >= 0.0) || !(gain <= MAX_GAIN)) {
+        return false;
+      }
+      t->gain *= (float)gain;
+    } else if (strchr(token, '=') == NULL && t->step == TRIGGER_NEXT_STEP) {
+      if (!find_step(data, token, t)) {
+        fprintf(stderr, "Unknown step label: %s\n", token);
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Switches to the sequence called `name` at the next step boundary.
+static void select_sequence(event_loop_data *data, const char *name) {
+  for (size_t i = 0; i < data->data.sequence_count; i++) {
+    if (strcmp(data->data.sequences[i].name, name) == 0) {
+      set_selected(data, i);
+      atomic_store_explicit(&data->pending_sequence, i, memory_order_release);
+      return;
+    }
+  }
+  fprintf(stderr, "Unknown sequence: %s\n", name);
+}
+
+void send_status(event_loop_data *data, int fd, struct sockaddr_un *addr,
+                 socklen_t addr_len) {
+  char reply[256];
+  trigger_queue *q = &data->queue;
+  trigger_queue *rq = &data->ring_queue;
+
+  // Nothing to report until the first command starts the audio
+  if (!data->audio_started) {
+    int len = snprintf(reply, sizeof(reply), "STATUS state=UNLOADED\n");
+    if (sendto(fd, reply, len, 0, (struct sockaddr *)addr, addr_len) < 0) {
+      perror("sendto");
+    }
+    return;
+  }
+
+  int len = snprintf(
+      reply, sizeof(reply),
+      "STATUS state=%s sequence=%s step=%zu queued=%u depth=%u overflow=%s "
+      "dropped=%llu coalesced=%llu skipped=%llu interval_ms=%.1f "
+      "wake_ms=%.1f latency_ms=%.1f\n",
+      is_playing(data) ? "PLAYING"
+      : data->released ? "RELEASED"
+                       : "IDLE",
+      data->data.sequences[selected(data)].name, data->current_step,
+      pending_triggers(data), q->depth, OVERFLOW_NAMES[q->overflow],
+      (unsigned long long)(atomic_load(&q->dropped) +
+                           atomic_load(&rq->dropped)),
+      (unsigned long long)(atomic_load(&q->coalesced) +
+                           atomic_load(&rq->coalesced)),
+      (unsigned long long)atomic_load(&data->skipped),
+      data->trigger_interval_avg * 1000.0 / DEFAULT_RATE,
+      (double)atomic_load(&data->wake_ns) / 1e6,
+      (double)atomic_load(&data->latency_ns) / 1e6);
+
+  if (sendto(fd, reply, len, 0, (struct sockaddr *)addr, addr_len) < 0) {
+    perror("sendto");
+  }
+}
+
+static void send_reply(int fd, struct sockaddr_un *addr, socklen_t addr_len,
+                       const char *reply) {
+  if (sendto(fd, reply, strlen(reply), 0, (struct sockaddr *)addr, addr_len) <
+      0) {
+    perror("sendto");
+  }
+}
+
+// Replies the output latency in nanoseconds, and the time it was sampled at,
+// for clients scheduling PLAYs with `at=`.
+static void send_latency(event_loop_data *data, int fd,
+                         struct sockaddr_un *addr, socklen_t addr_len) {
+  char reply[128];
+  if (!data->audio_started) {
+    send_reply(fd, addr, addr_len, "LATENCY state=UNLOADED\n");
+    return;
+  }
+
+  snprintf(reply, sizeof(reply), "LATENCY latency=%lld now=%lld\n",
+           (long long)atomic_load(&data->latency_ns),
+           (long long)monotonic_ns());
+  send_reply(fd, addr, addr_len, reply);
+}
+
+// Unmaps a ring once `on_process` is done with it.
+static void free_ring(event_loop_data *data, size_t i) {
+  command_ring_destroy(&data->rings[i]);
+  atomic_store(&data->rings[i].state, RING_FREE);
+  printf("Closed command ring %zu\n", i);
+}
+
+// Stops watching ring `i` and frees it, right away if `on_process` is not
+// running, since any later run sees it closing, or otherwise once
+// `on_process` acknowledged it, see `on_ring_closed`.
+static void close_ring(event_loop_data *data, size_t i) {
+  command_ring *r = &data->rings[i];
+  struct pw_loop *loop = pw_main_loop_get_loop(data->loop);
+
+  pw_loop_destroy_source(loop, data->ring_wake_sources[i]);
+  if (data->ring_owner_sources[i]) {
+    pw_loop_destroy_source(loop, data->ring_owner_sources[i]);
+    data->ring_owner_sources[i] = NULL;
+  }
+  if (r->owner_fd >= 0) {
+    close(r->owner_fd);
+    r->owner_fd = -1;
+  }
+
+  atomic_store(&r->state, RING_CLOSING);
+  int closing = RING_CLOSING;
+  if ((atomic_load(&data->process_epoch) & 1) == 0 &&
+      atomic_compare_exchange_strong(&r->state, &closing, RING_CLOSED)) {
+    free_ring(data, i);
+  }
+}
+
+static void on_ring_closed(void *userdata, uint64_t count) {
+  event_loop_data *data = userdata;
+  for (size_t i = 0; i < MAX_RINGS; i++) {
+    if (atomic_load(&data->rings[i].state) == RING_CLOSED) {
+      free_ring(data, i);
+    }
+  }
+}
+
+// The client of a ring exited without UNRING
+static void on_ring_owner_exit(void *userdata, int fd, uint32_t mask) {
+  event_loop_data *data = userdata;
+  for (size_t i = 0; i < MAX_RINGS; i++) {
+    if (atomic_load(&data->rings[i].state) == RING_ACTIVE &&
+        data->rings[i].owner_fd == fd) {
+      close_ring(data, i);
+      return;
+    }
+  }
+}
+
+// A client posted to a ring while `on_process` was not polling them
+static void on_ring_wake(void *userdata, int fd, uint32_t mask) {
+  event_loop_data *data = userdata;
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0 || !ensure_audio(data)) {
+    return;
+  }
+
+  // Wakes up for the first command waiting, if it is valid
+  trigger t = {
+      .step = TRIGGER_NEXT_STEP, .skip = 0, .rate = 1.0f, .gain = 1.0f};
+  for (size_t i = 0; i < MAX_RINGS; i++) {
+    command_ring *r = &data->rings[i];
+    if (atomic_load(&r->state) == RING_ACTIVE && r->eventfd == fd &&
+        command_ring_pending(r) > 0) {
+      uint32_t head = atomic_load(&r->ring->head);
+      command_trigger(data, &r->ring->commands[head % MBAS_RING_SLOTS], &t);
+    }
+  }
+  resume_stream(data, &t);
+}
+
+// Watches ring `i` of the process `pid` and lets `on_process` poll it. The
+// ring is closed on UNRING or when `pid` exits. Returns false if `pid` is
+// gone already.
+static bool watch_ring(event_loop_data *data, size_t i, pid_t pid) {
+  command_ring *r = &data->rings[i];
+  struct pw_loop *loop = pw_main_loop_get_loop(data->loop);
+  r->owner = pid;
+  r->owner_fd = pid > 0 ? (int)syscall(SYS_pidfd_open, pid, 0) : -1;
+  bool alive = pid <= 0 || r->owner_fd >= 0 || errno != ESRCH;
+  data->ring_owner_sources[i] =
+      r->owner_fd >= 0 ? pw_loop_add_io(loop, r->owner_fd, SPA_IO_IN, false,
+                                        on_ring_owner_exit, data)
+                       : NULL;
+  data->ring_wake_sources[i] =
+      pw_loop_add_io(loop, r->eventfd, SPA_IO_IN, false, on_ring_wake, data);
+  atomic_store(&r->state, RING_ACTIVE);
+  return alive;
+}
+
+// Replies to RING from the process `pid` with the memfd of a new ring and its
+// eventfd.
+static void open_ring(event_loop_data *data, int fd, struct sockaddr_un *addr,
+                      socklen_t addr_len, pid_t pid) {
+  size_t i = 0;
+  while (i < MAX_RINGS && atomic_load(&data->rings[i].state) != RING_FREE) {
+    i++;
+  }
+  if (i == MAX_RINGS) {
+    fprintf(stderr, "Too many command rings, RING refused\n");
+    send_reply(fd, addr, addr_len, "RING error=full\n");
+    return;
+  }
+
+  command_ring *r = &data->rings[i];
+  if (!command_ring_create(r)) {
+    send_reply(fd, addr, addr_len, "RING error=failed\n");
+    return;
+  }
+
+  char reply[64];
+  snprintf(reply, sizeof(reply), "RING slots=%d\n", MBAS_RING_SLOTS);
+  struct iovec iov = {.iov_base = reply, .iov_len = strlen(reply)};
+  int fds[2] = {r->memfd, r->eventfd};
+  union {
+    char buffer[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+      .msg_name = addr,
+      .msg_namelen = addr_len,
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buffer,
+      .msg_controllen = sizeof(control.buffer),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(fd, &msg, 0) < 0) {
+    perror("sendmsg");
+    command_ring_destroy(r);
+    return;
+  }
+
+  watch_ring(data, i, pid);
+  printf("Opened command ring %zu for pid %d\n", i, (int)pid);
+}
+
+// Takes over the command rings of the process this one replaced. Commands
+// posted while neither process polled them are picked up as if the client
+// had written to the eventfd.
+static void adopt_rings(event_loop_data *data, const handover *h) {
+  for (uint32_t i = 0; i < h->ring_count && i < MAX_RINGS; i++) {
+    command_ring *r = &data->rings[i];
+    if (!command_ring_adopt(r, h->rings[i].memfd, h->rings[i].eventfd)) {
+      fprintf(stderr, "Invalid command ring from the previous process\n");
+      continue;
+    }
+    if (!watch_ring(data, i, h->rings[i].owner)) {
+      close_ring(data, i);
+      continue;
+    }
+    uint64_t one = 1;
+    if (command_ring_pending(r) > 0 &&
+        write(r->eventfd, &one, sizeof(one)) < 0) {
+      perror("write");
+    }
+    printf("Kept command ring %u of pid %d\n", i, (int)r->owner);
+  }
+}
+
+// Closes the rings of the process `pid`
+static void close_rings(event_loop_data *data, pid_t pid) {
+  for (size_t i = 0; i < MAX_RINGS; i++) {
+    if (atomic_load(&data->rings[i].state) == RING_ACTIVE &&
+        data->rings[i].owner == pid) {
+      close_ring(data, i);
+    }
+  }
+}
+
+static const char *const ACK_RESULT_NAMES[] = {
+    [MBAS_ACK_ACCEPTED] = "accepted", [MBAS_ACK_QUEUED] = "queued",
+    [MBAS_ACK_DROPPED] = "dropped",   [MBAS_ACK_COALESCED] = "coalesced",
+    [MBAS_ACK_INVALID] = "invalid",
+};
+
+// `seq` of a PLAY that asked for no ack
+#define NO_ACK (-1)
+
+// Datagrams read per wake-up of the main loop. Any left over wake it again.
+#define RECV_BATCH 16
+
+// Acks for the PLAYs read by one `on_msg`, sent together once they are all
+// handled.
+struct ack_batch {
+  unsigned int count;
+  struct sockaddr_un addrs[RECV_BATCH];
+  char buffers[RECV_BATCH][128];
+  struct iovec iovs[RECV_BATCH];
+  struct mmsghdr msgs[RECV_BATCH];
+};
+
+typedef struct ack_batch ack_batch;
+
+// Adds the ack for PLAY `seq` from `addr`, in the format of the PLAY.
+static void add_ack(ack_batch *acks, struct sockaddr_un *addr,
+                    socklen_t addr_len, bool binary, uint32_t seq, int result,
+                    int64_t time_ns, int64_t latency_ns) {
+  // Unbound clients have no address to reply to
+  if (addr_len <= sizeof(sa_family_t)) {
+    fprintf(stderr, "PLAY seq= from unbound socket, not replying\n");
+    return;
+  }
+
+  unsigned int i = acks->count++;
+  size_t len;
+  if (binary) {
+    struct mbas_ack ack = {.type = MBAS_REPLY_ACK,
+                           .result = (uint8_t)result,
+                           .reserved = 0,
+                           .seq = seq,
+                           .time_ns = time_ns,
+                           .latency_ns = latency_ns};
+    memcpy(acks->buffers[i], &ack, sizeof(ack));
+    len = sizeof(ack);
+  } else {
+    len = (size_t)snprintf(acks->buffers[i], sizeof(acks->buffers[i]),
+                           "ACK seq=%u result=%s time=%lld latency=%lld\n",
+                           seq, ACK_RESULT_NAMES[result], (long long)time_ns,
+                           (long long)latency_ns);
+  }
+
+  memcpy(&acks->addrs[i], addr, addr_len);
+  acks->iovs[i] = (struct iovec){.iov_base = acks->buffers[i], .iov_len = len};
+  acks->msgs[i].msg_hdr = (struct msghdr){
+      .msg_name = &acks->addrs[i],
+      .msg_namelen = addr_len,
+      .msg_iov = &acks->iovs[i],
+      .msg_iovlen = 1,
+  };
+}
+
+static void send_acks(int fd, ack_batch *acks) {
+  unsigned int i = 0;
+  while (i < acks->count) {
+    int sent = sendmmsg(fd, acks->msgs + i, acks->count - i, MSG_DONTWAIT);
+    if (sent < 0) {
+      // Skips the client that could not be reached
+      perror("sendmmsg");
+      i++;
+    } else {
+      i += (unsigned int)sent;
+    }
+  }
+}
+
+// Queues the PLAY `t` and makes sure the stream runs to play it. Returns what
+// became of it, one of `mbas_ack_result`, and sets `onset_ns` to when it is
+// expected to be heard.
+static int queue_play(event_loop_data *data, const trigger *t,
+                      int64_t *onset_ns) {
+  int64_t now = monotonic_ns() +
+                atomic_load_explicit(&data->latency_ns, memory_order_relaxed);
+  bool idle = !is_playing(data) && pending_triggers(data) == 0;
+
+  int res = trigger_queue_push(&data->queue, t);
+  if (res == TRIGGER_DROPPED) {
+    fprintf(stderr, "Trigger queue full, PLAY dropped\n");
+  }
+  if (!resume_stream(data, t)) {
+    res = TRIGGER_DROPPED;
+  }
+
+  *onset_ns = 0;
+  switch (res) {
+  case TRIGGER_DROPPED:
+    return MBAS_ACK_DROPPED;
+  case TRIGGER_COALESCED:
+    return MBAS_ACK_COALESCED;
+  }
+  // After the step being played and every step queued before this one, each
+  // assumed as long as the current one, and not before `at=`
+  int64_t end = atomic_load_explicit(&data->step_end_ns, memory_order_relaxed);
+  int64_t step = atomic_load_explicit(&data->step_ns, memory_order_relaxed);
+  // `on_process` may have taken it off the queue already
+  uint32_t position = pending_triggers(data);
+  uint32_t ahead = position > 0 ? position - 1 : 0;
+  *onset_ns = idle ? now : (end > now ? end : now) + (int64_t)ahead * step;
+  if (t->at_ns > *onset_ns) {
+    *onset_ns = t->at_ns;
+  }
+  return idle ? MBAS_ACK_ACCEPTED : MBAS_ACK_QUEUED;
+}
+
+// Process that sent `msg`, from the credentials the kernel attaches to it,
+// see SO_PASSCRED. 0 if unknown.
+static pid_t sender_pid(struct msghdr *msg) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_CREDENTIALS) {
+      struct ucred cred;
+      memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+      return cred.pid;
+    }
+  }
+  return 0;
+}
+
+// Runs the command in `buffer`, `n` bytes long and NUL terminated, received
+// from `addr`.
+static void on_command(event_loop_data *data, int fd, char *buffer, size_t n,
+                       struct sockaddr_un *addr, socklen_t addr_len,
+                       pid_t pid, ack_batch *acks) {
+  int64_t onset_ns = 0;
+  int result;
+
+  if (mbas_is_binary_command(buffer, n)) {
+    struct mbas_command c;
+    memcpy(&c, buffer, sizeof(c));
+    if (!ensure_audio(data)) {
+      return;
+    }
+    if (data->stretch) {
+      update_trigger_interval(data);
+    }
+    trigger t;
+    if (command_trigger(data, &c, &t)) {
+      result = queue_play(data, &t, &onset_ns);
+    } else {
+      fprintf(stderr, "Invalid binary PLAY\n");
+      result = MBAS_ACK_INVALID;
+    }
+    if (c.flags & MBAS_FLAG_ACK) {
+      add_ack(acks, addr, addr_len, true, c.seq, result, onset_ns,
+              atomic_load(&data->latency_ns));
+    }
+  } else if (strncmp(buffer, PLAY_COMMAND, 4) == 0) {
+    // Start playback
+    printf("Received PLAY command\n");
+    if (!ensure_audio(data)) {
+      return;
+    }
+    if (data->stretch) {
+      update_trigger_interval(data);
+    }
+    trigger t = {
+        .step = TRIGGER_NEXT_STEP, .skip = 0, .rate = 1.0f, .gain = 1.0f};
+    int64_t seq = NO_ACK;
+    if (parse_play_args(data, buffer + 4, &t, &seq)) {
+      result = queue_play(data, &t, &onset_ns);
+    } else {
+      fprintf(stderr, "Invalid PLAY arguments: %s\n", buffer + 4);
+      result = MBAS_ACK_INVALID;
+    }
+    if (seq != NO_ACK) {
+      add_ack(acks, addr, addr_len, false, (uint32_t)seq, result, onset_ns,
+              atomic_load(&data->latency_ns));
+    }
+  } else if (strncmp(buffer, SELECT_COMMAND, 6) == 0) {
+    if (!ensure_audio(data)) {
+      return;
+    }
+    char *saveptr = NULL;
+    char *name = strtok_r(buffer + 6, " \t\r\n", &saveptr);
+    if (!name) {
+      fprintf(stderr, "SELECT needs a sequence name\n");
+      return;
+    }
+    select_sequence(data, name);
+  } else if (strncmp(buffer, STATUS_COMMAND, 6) == 0) {
+    // Unbound clients have no address to reply to
+    if (addr_len <= sizeof(sa_family_t)) {
+      fprintf(stderr, "STATUS from unbound socket, not replying\n");
+      return;
+    }
+    send_status(data, fd, addr, addr_len);
+  } else if (strncmp(buffer, LATENCY_COMMAND, 7) == 0) {
+    if (addr_len <= sizeof(sa_family_t)) {
+      fprintf(stderr, "LATENCY from unbound socket, not replying\n");
+      return;
+    }
+    send_latency(data, fd, addr, addr_len);
+  } else if (strncmp(buffer, UNRING_COMMAND, 6) == 0) {
+    close_rings(data, pid);
+  } else if (strncmp(buffer, RING_COMMAND, 4) == 0) {
+    if (addr_len <= sizeof(sa_family_t)) {
+      fprintf(stderr, "RING from unbound socket, not replying\n");
+      return;
+    }
+    open_ring(data, fd, addr, addr_len, pid);
+  } else {
+    fprintf(stderr, "Unknown command received: %s\n", buffer);
+  }
+}
+
+
+void on_msg(void *userdata, int fd, uint32_t mask) {
+  event_loop_data *data = userdata;
+  char buffers[RECV_BATCH][256];
+  struct sockaddr_un addrs[RECV_BATCH];
+  union {
+    char buffer[CMSG_SPACE(sizeof(struct ucred))];
+    struct cmsghdr align;
+  } controls[RECV_BATCH];
+  struct iovec iovs[RECV_BATCH];
+  struct mmsghdr msgs[RECV_BATCH];
+
+  for (int i = 0; i < RECV_BATCH; i++) {
+    iovs[i].iov_base = buffers[i];
+    iovs[i].iov_len = sizeof(buffers[i]) - 1;
+    msgs[i].msg_hdr = (struct msghdr){
+        .msg_name = &addrs[i],
+        .msg_namelen = sizeof(addrs[i]),
+        .msg_iov = &iovs[i],
+        .msg_iovlen = 1,
+        .msg_control = controls[i].buffer,
+        .msg_controllen = sizeof(controls[i].buffer),
+    };
+  }
+
+  int count = recvmmsg(fd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+  if (count < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("recvmmsg");
+    }
+    return;
+  }
+
+  ack_batch acks;
+  acks.count = 0;
+  for (int i = 0; i < count; i++) {
+    buffers[i][msgs[i].msg_len] = '\0';
+    on_command(data, fd, buffers[i], msgs[i].msg_len, &addrs[i],
+               msgs[i].msg_hdr.msg_namelen, sender_pid(&msgs[i].msg_hdr),
+               &acks);
+  }
+  send_acks(fd, &acks);
+}
+
+#ifdef MBAS_WITH_IO_URING
+
+// Acks of the datagrams drained by one `on_uring`
+struct uring_batch {
+  event_loop_data *data;
+  ack_batch acks;
+};
+
+static void on_datagram(void *userdata, datagram *d) {
+  struct uring_batch *batch = userdata;
+  // Sent early to make room, since a drain is not bounded by RECV_BATCH
+  if (batch->acks.count == RECV_BATCH) {
+    send_acks(batch->data->sockfd, &batch->acks);
+    batch->acks.count = 0;
+  }
+  on_command(batch->data, batch->data->sockfd, d->payload, d->length, d->addr,
+             d->addr_len, sender_pid(&d->control), &batch->acks);
+}
+
+// Reads the command socket with `on_msg` from now on
+static void uring_fallback(event_loop_data *data) {
+  fprintf(stderr, "io_uring receive failed, falling back to recvmmsg\n");
+  struct pw_loop *loop = pw_main_loop_get_loop(data->loop);
+  pw_loop_destroy_source(loop, data->uring_source);
+  data->uring_source = NULL;
+  datagram_uring_free(&data->uring);
+  pw_loop_add_io(loop, data->sockfd, SPA_IO_IN, false, on_msg, data);
+}
+
+// Reads the command socket like `on_msg`, from the completions of the
+// io_uring receive. Falls back to `on_msg` if the receive fails for good.
+static void on_uring(void *userdata, int fd, uint32_t mask) {
+  event_loop_data *data = userdata;
+  struct uring_batch batch = {.data = data};
+  batch.acks.count = 0;
+
+  bool ok = datagram_uring_drain(&data->uring, on_datagram, &batch);
+  send_acks(data->sockfd, &batch.acks);
+  if (!ok) {
+    uring_fallback(data);
+  }
+}
+
+// Stops the io_uring receive for `upgrade`, running the commands it read
+// already, which the next process would not see.
+static void stop_uring(event_loop_data *data) {
+  struct uring_batch batch = {.data = data};
+  batch.acks.count = 0;
+  datagram_uring_stop(&data->uring, on_datagram, &batch);
+  send_acks(data->sockfd, &batch.acks);
+}
+
+static void resume_uring(event_loop_data *data) {
+  if (!datagram_uring_resume(&data->uring)) {
+    uring_fallback(data);
+  }
+}
+
+#endif
+
+// Plays a step for `/mbas/play`, or `/mbas/play/<label>` to jump to a step.
+// The arguments are all optional: the velocity, as an int in [0, 127] or a
+// float in [0, 1], then the rate and the gain as floats. A velocity of 0,
+// like a button being released, plays nothing.
+static void osc_play(event_loop_data *data, osc_message *m, const char *label,
+                     uint64_t timetag) {
+  trigger t = {.step = TRIGGER_NEXT_STEP,
+               .skip = 0,
+               .rate = 1.0f,
+               .gain = 1.0f,
+               .at_ns = osc_timetag_ns(timetag)};
+
+  osc_arg arg;
+  for (int i = 0; osc_next_arg(m, &arg); i++) {
+    if (arg.type != 'i' && arg.type != 'f') {
+      goto invalid;
+    }
+    float value = arg.type == 'i' ? (float)arg.i : arg.f;
+
+    if (i == 0) {
+      long velocity = arg.type == 'i' ? arg.i : lroundf(value * MAX_VELOCITY);
+      if (velocity == 0) {
+        return;
+      }
+      if (velocity < 0 || velocity > MAX_VELOCITY) {
+        goto invalid;
+      }
+      t.gain *= data->velocity_curve[velocity];
+    } else if (i == 1) {
+      if (!(value >= MIN_PLAYBACK_RATE) || !(value <= MAX_PLAYBACK_RATE)) {
+        goto invalid;
+      }
+      t.rate = value;
+    } else if (i == 2) {
+      if (!(value >= 0.0f) || !(value <= MAX_GAIN)) {
+        goto invalid;
+      }
+      t.gain *= value;
+    } else {
+      goto invalid;
+    }
+  }
+  // Arguments left means one was malformed
+  if (*m->types != '\0') {
+    goto invalid;
+  }
+
+  if (!ensure_audio(data)) {
+    return;
+  }
+  if (!valid_at(data, t.at_ns)) {
+    fprintf(stderr, "OSC bundle for %s is scheduled too far ahead\n",
+            m->address);
+    return;
+  }
+  if (label) {
+    if (!find_step(data, label, &t)) {
+      fprintf(stderr, "Unknown step label: %s\n", label);
+      return;
+    }
+  }
+  if (data->stretch) {
+    update_trigger_interval(data);
+  }
+  int64_t onset_ns;
+  queue_play(data, &t, &onset_ns);
+  return;
+
+invalid:
+  fprintf(stderr, "Invalid OSC arguments for %s\n", m->address);
+}
+
+static void on_osc_message(void *userdata, osc_message *m, uint64_t timetag) {
+  event_loop_data *data = userdata;
+  const char *address = m->address;
+
+  if (strcmp(address, "/mbas/play") == 0) {
+    osc_play(data, m, NULL, timetag);
+  } else if (strncmp(address, "/mbas/play/", 11) == 0) {
+    osc_play(data, m, address + 11, timetag);
+  } else if (strcmp(address, "/mbas/select") == 0) {
+    osc_arg arg;
+    if (!osc_next_arg(m, &arg) || arg.type != 's') {
+      fprintf(stderr, "/mbas/select needs a sequence name\n");
+      return;
+    }
+    if (!ensure_audio(data)) {
+      return;
+    }
+    select_sequence(data, arg.s);
+  } else {
+    fprintf(stderr, "Unknown OSC address: %s\n", address);
+  }
+}
+
+void on_osc(void *userdata, int fd, uint32_t mask) {
+  event_loop_data *data = userdata;
+  uint8_t buffers[RECV_BATCH][OSC_MAX_PACKET];
+  struct iovec iovs[RECV_BATCH];
+  struct mmsghdr msgs[RECV_BATCH];
+
+  for (int i = 0; i < RECV_BATCH; i++) {
+    iovs[i].iov_base = buffers[i];
+    iovs[i].iov_len = sizeof(buffers[i]);
+    msgs[i].msg_hdr = (struct msghdr){.msg_iov = &iovs[i], .msg_iovlen = 1};
+  }
+
+  int count = recvmmsg(fd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+  if (count < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("recvmmsg");
+    }
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      fprintf(stderr, "OSC packet too long, dropped\n");
+    } else if (!osc_parse_packet(buffers[i], msgs[i].msg_len, OSC_IMMEDIATELY,
+                                 0, on_osc_message, data)) {
+      fprintf(stderr, "Malformed OSC packet\n");
+    }
+  }
+}
+
+static void on_order_exhausted(void *userdata, uint64_t count) {
+  event_loop_data *data = userdata;
+  orders_refill(data->orders, data->data.sequence_count);
+}
+
+static void do_quit(void *userdata, int signal_number) {
+  event_loop_data *data = userdata;
+  pw_main_loop_quit(data->loop);
+}
+
+// First fd passed by the service manager, see sd_listen_fds(3)
+#define LISTEN_FDS_START 3
+
+// Takes the command socket passed by the service manager with the LISTEN_FDS
+// protocol, e.g. by a systemd `.socket` unit. Returns false if there is none,
+// and sets `*fd` to -1 if it cannot be used.
+static bool activated_socket(int *fd) {
+  const char *pid = getenv("LISTEN_PID");
+  const char *fds = getenv("LISTEN_FDS");
+  if (!pid || !fds || strtol(pid, NULL, 10) != (long)getpid()) {
+    return false;
+  }
+
+  long count = strtol(fds, NULL, 10);
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  if (count < 1) {
+    return false;
+  }
+  if (count > 1) {
+    fprintf(stderr,
+            "Got %ld sockets from the service manager, using the first one\n",
+            count);
+  }
+
+  *fd = LISTEN_FDS_START;
+
+  int type;
+  socklen_t len = sizeof(type);
+  if (getsockopt(*fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 ||
+      type != SOCK_DGRAM) {
+    fprintf(stderr, "Socket from the service manager is not a datagram one\n");
+    goto fail;
+  }
+
+  // The service manager does not set either
+  int flags = fcntl(*fd, F_GETFL, 0);
+  if (flags == -1 || fcntl(*fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+      fcntl(*fd, F_SETFD, FD_CLOEXEC) == -1) {
+    perror("fcntl");
+    goto fail;
+  }
+
+  printf("Server is listening on the socket from the service manager\n");
+  return true;
+
+fail:
+  *fd = -1;
+  return true;
+}
+
+// Binds the non-blocking command socket at SOCKET_PATH. Returns its fd, or
+// -1.
+static int open_socket(void) {
+  int sockfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+  if (sockfd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, SOCKET_PATH);
+
+  unlink(SOCKET_PATH);
+
+  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    goto close_socket;
+  }
+
+  // Set socket to non-blocking
+  int flags = fcntl(sockfd, F_GETFL, 0);
+  if (flags == -1) {
+    perror("fcntl");
+    goto close_socket;
+  }
+  flags |= O_NONBLOCK;
+  if (fcntl(sockfd, F_SETFL, flags) == -1) {
+    perror("fcntl");
+    goto close_socket;
+  }
+
+  printf("Server is listening on %s\n", SOCKET_PATH);
+  return sockfd;
+
+close_socket:
+  close(sockfd);
+  return -1;
+}
+
+// Binds the UDP socket for OSC messages, see `osc.port`.
+static int open_osc_socket(const Config *config) {
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(config->osc.port)};
+  if (inet_pton(AF_INET, config->osc.address, &addr.sin_addr) != 1) {
+    fprintf(stderr, "Invalid osc.address: %s\n", config->osc.address);
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+
+  printf("Listening for OSC on %s:%u\n", config->osc.address,
+         (unsigned)config->osc.port);
+  return fd;
+}
+
+int main(int argc, char *argv[]) {
+  int status = EXIT_FAILURE;
+  struct timespec phase;
+  clock_gettime(CLOCK_MONOTONIC, &phase);
+
+  // Load configuration
+  Config config;
+  load_config_result_t res = load_config(&config);
+
+  if (res.code != LOAD_CONFIG_SUCCESS) {
+    fprintf(stderr, "Failed to load config: %s\n", res.errmsg);
+    free(res.errmsg);
+    return res.code;
+  }
+
+  double config_ms = lap_ms(&phase);
+
+  // Take the socket from the previous process or the service manager, or
+  // setup the UNIX domain socket server. Done first so PLAYs sent while
+  // starting up wait in the socket instead of being refused.
+  handover *inherited = handover_read();
+  int sockfd;
+  int osc_fd = -1;
+  if (inherited) {
+    sockfd = inherited->socket_fd;
+    printf("Server is listening on the socket of the previous process\n");
+  } else if (!activated_socket(&sockfd)) {
+    sockfd = open_socket();
+  }
+
+  if (sockfd < 0) {
+    goto free_config;
+  }
+
+  if (config.osc.port > 0) {
+    osc_fd = open_osc_socket(&config);
+    if (osc_fd < 0) {
+      goto close_socket;
+    }
+  }
+
+  double socket_ms = lap_ms(&phase);
+
+  // TODO: Make backend variable
+  // Initialize audio backend
+  event_loop_data data;
+  data.stream = NULL;
+  data.orders = NULL;
+  data.config = &config;
+  data.audio_started = false;
+  data.failed = false;
+  data.idle_timer = NULL;
+  data.released = false;
+  atomic_init(&data.wake_started_ns, 0);
+  atomic_init(&data.wake_ns, 0);
+  data.sockfd = sockfd;
+  data.argv = argv;
+  data.inherited = inherited;
+  data.resumed = false;
+  data.state.file = NULL;
+#ifdef MBAS_WITH_IO_URING
+  data.uring_source = NULL;
+#endif
+  for (size_t i = 0; i < MAX_RINGS; i++) {
+    atomic_init(&data.rings[i].state, RING_FREE);
+    data.ring_owner_sources[i] = NULL;
+  }
+  atomic_init(&data.process_epoch, 0);
+
+  if (!trigger_queue_init(&data.queue, config.queue.depth,
+                          config.queue.overflow)) {
+    fprintf(stderr, "Failed to allocate trigger queue\n");
+    goto close_socket;
+  }
+  if (!trigger_queue_init(&data.ring_queue, config.queue.depth,
+                          config.queue.overflow)) {
+    fprintf(stderr, "Failed to allocate trigger queue\n");
+    trigger_queue_free(&data.queue);
+    goto close_socket;
+  }
+
+  // For the pid of the clients asking for a ring
+  int passcred = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_PASSCRED, &passcred,
+                 sizeof(passcred)) < 0) {
+    perror("setsockopt");
+  }
+
+  data.catch_up_threshold = config.catch_up.threshold;
+  data.fade_len = config.catch_up.crossfade_ms * DEFAULT_RATE / 1000;
+  data.stretch = config.time_stretch.enabled;
+  data.stretch_smoothing = config.time_stretch.smoothing;
+  data.stretch_max_ratio = config.time_stretch.max_ratio;
+  memcpy(data.velocity_curve, config.velocity.curve,
+         sizeof(data.velocity_curve));
+
+  pw_init(0, 0);
+
+  data.loop = pw_main_loop_new(0 /* properties */);
+
+  // Set handlers for SIGINT and SIGTERM to stop the main loop
+  pw_loop_add_signal(pw_main_loop_get_loop(data.loop), SIGINT, do_quit, &data);
+  pw_loop_add_signal(pw_main_loop_get_loop(data.loop), SIGTERM, do_quit, &data);
+  pw_loop_add_signal(pw_main_loop_get_loop(data.loop), SIGUSR2, upgrade, &data);
+
+  data.order_event = pw_loop_add_event(pw_main_loop_get_loop(data.loop),
+                                       on_order_exhausted, &data);
+  data.ring_event = pw_loop_add_event(pw_main_loop_get_loop(data.loop),
+                                      on_ring_closed, &data);
+
+  if (config.idle.timeout_s > 0) {
+    data.idle_timer =
+        pw_loop_add_timer(pw_main_loop_get_loop(data.loop), on_idle, &data);
+  }
+
+  // The previous process had the audio started already
+  bool lazy = config.startup.lazy &&
+              !(inherited && inherited->sample.fd >= 0);
+  if (!lazy && !start_audio(&data)) {
+    goto cleanup_backend;
+  }
+
+  if (inherited) {
+    adopt_rings(&data, inherited);
+    if (data.audio_started) {
+      resume_playback(&data, inherited);
+    }
+    free(inherited);
+    inherited = NULL;
+    data.inherited = NULL;
+  }
+
+  // Register socket fd with the main loop
+  bool uring = false;
+#ifdef MBAS_WITH_IO_URING
+  if (datagram_uring_init(&data.uring, sockfd)) {
+    data.uring_source = pw_loop_add_io(pw_main_loop_get_loop(data.loop),
+                                       datagram_uring_fd(&data.uring),
+                                       SPA_IO_IN, false, on_uring, &data);
+    if (!data.uring_source) {
+      datagram_uring_free(&data.uring);
+    }
+  }
+  uring = data.uring_source != NULL;
+  if (!uring) {
+    fprintf(stderr, "io_uring not available, using recvmmsg\n");
+  }
+#endif
+  if (!uring) {
+    pw_loop_add_io(pw_main_loop_get_loop(data.loop), sockfd, SPA_IO_IN, false,
+                   on_msg, &data);
+  }
+  if (osc_fd >= 0) {
+    pw_loop_add_io(pw_main_loop_get_loop(data.loop), osc_fd, SPA_IO_IN, false,
+                   on_osc, &data);
+  }
+
+  double audio_ms = lap_ms(&phase);
+  if (lazy) {
+    printf("Started in %.1f ms: config %.1f ms, socket %.1f ms, audio "
+           "deferred to the first command\n",
+           config_ms + socket_ms + audio_ms, config_ms, socket_ms);
+  } else {
+    printf("Started in %.1f ms: config %.1f ms, socket %.1f ms, audio %.1f "
+           "ms\n",
+           config_ms + socket_ms + audio_ms, config_ms, socket_ms, audio_ms);
+  }
+
+  // Finally!!!
+  // Run the main loop
+  pw_main_loop_run(data.loop);
+  status = data.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  // Cleanup
+cleanup_backend:
+  if (data.stream) {
+    pw_stream_destroy(data.stream);
+  }
+  for (size_t i = 0; i < MAX_RINGS; i++) {
+    command_ring *r = &data.rings[i];
+    if (atomic_load(&r->state) != RING_FREE) {
+      if (r->owner_fd >= 0) {
+        close(r->owner_fd);
+      }
+      command_ring_destroy(r);
+    }
+  }
+  pw_main_loop_destroy(data.loop);
+#ifdef MBAS_WITH_IO_URING
+  if (data.uring_source) {
+    datagram_uring_free(&data.uring);
+  }
+#endif
+  pw_deinit();
+  trigger_queue_free(&data.queue);
+  trigger_queue_free(&data.ring_queue);
+  orders_free(data.orders);
+  state_close(&data.state);
+close_socket:
+  if (osc_fd >= 0) {
+    close(osc_fd);
+  }
+  close(sockfd);
+free_config:
+  if (inherited) {
+    handover_discard(inherited);
+  }
+  free_config(&config);
+  return status;
 }
@@ -0,0 +1,353 @@
+#ifndef MBAS_ORDER_C
+#define MBAS_ORDER_C
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "config.c"
+#include "data.c"
+
+// Precomputed order in which the steps of a sequence are played.
+//
+// Each order has two blocks of step indices. `on_process` reads one of them
+// front to back and, once it is exhausted, hands it back to the main loop to
+// be regenerated while it moves on to the other one. A block belongs to
+// `on_process` while `ready` is set and to the main loop otherwise. If the
+// other block is not ready in time, the exhausted one is simply read again.
+struct order_block {
+  uint32_t *steps;
+  uint32_t length;
+  _Atomic bool ready;
+};
+
+struct order {
+  OrderMode mode;
+  const Sequence *sequence;
+
+  // "weighted" only, see `order_pick_weighted`. `cumulative[i]` is the sum of
+  // the weights of steps [0, i]. The transitions of step `i` given by its
+  // `next=` are [row_first[i], row_first[i + 1]) in `row_steps`, with their
+  // running sum of weights in `row_cumulative`.
+  double *cumulative;
+  uint32_t *row_first;
+  uint32_t *row_steps;
+  double *row_cumulative;
+
+  // Single allocation holding the blocks and the tables of every order, set
+  // on the first one
+  void *memory;
+
+  // Read by `on_process` only
+  struct order_block blocks[2];
+  uint32_t current;
+  uint32_t pos;
+
+  // Used by the main loop only, to generate blocks
+  uint64_t rng;
+  uint32_t last;
+};
+
+typedef struct order order;
+
+// xorshift64*
+static uint32_t order_random(order *o) {
+  o->rng ^= o->rng >> 12;
+  o->rng ^= o->rng << 25;
+  o->rng ^= o->rng >> 27;
+  return (uint32_t)((o->rng * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+// Uniform in [0, n)
+static uint32_t order_random_below(order *o, uint32_t n) {
+  return (uint32_t)(((uint64_t)order_random(o) * n) >> 32);
+}
+
+static float order_random_unit(order *o) {
+  return (float)(order_random(o) >> 8) / (float)(1 << 24);
+}
+
+// First of the `n` running sums in `cumulative` above `target`, the last one
+// if none is
+static uint32_t order_search(const double *cumulative, uint32_t n,
+                             double target) {
+  uint32_t lo = 0;
+  uint32_t hi = n - 1;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (cumulative[mid] > target) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+// Next step of the Markov chain from `last`: one of its `next=` transitions
+// by their weights if it has any, otherwise any step by its `weight=` but
+// `last` itself, unless it is the only step with any weight.
+static uint32_t order_pick_weighted(order *o) {
+  uint32_t length = (uint32_t)o->sequence->length;
+
+  if (o->last < length && o->row_first[o->last] < o->row_first[o->last + 1]) {
+    uint32_t first = o->row_first[o->last];
+    uint32_t n = o->row_first[o->last + 1] - first;
+    const double *row = o->row_cumulative + first;
+    double target = order_random_unit(o) * row[n - 1];
+    return o->row_steps[first + order_search(row, n, target)];
+  }
+
+  // Draws over the other steps, then shifts past the range of `last`
+  double skip_from = 0.0;
+  double skip = 0.0;
+  if (o->last < length && length > 1) {
+    skip_from = o->last > 0 ? o->cumulative[o->last - 1] : 0.0;
+    skip = o->cumulative[o->last] - skip_from;
+  }
+  double total = o->cumulative[length - 1] - skip;
+
+  if (total <= 0.0) {
+    uint32_t pick = order_random_below(o, length);
+    return length > 1 && pick == o->last ? (pick + 1) % length : pick;
+  }
+
+  double target = order_random_unit(o) * total;
+  if (target >= skip_from) {
+    target += skip;
+  }
+  return order_search(o->cumulative, length, target);
+}
+
+// Fills block `b`. Main loop only.
+static void order_generate(order *o, uint32_t b) {
+  struct order_block *block = &o->blocks[b];
+  uint32_t length = (uint32_t)o->sequence->length;
+
+  switch (o->mode) {
+  case ORDER_LINEAR:
+    for (uint32_t i = 0; i < length; i++) {
+      block->steps[i] = i;
+    }
+    break;
+  case ORDER_PINGPONG:
+    // 0 1 .. n-1 n-2 .. 1
+    for (uint32_t i = 0; i < length; i++) {
+      block->steps[i] = i;
+    }
+    for (uint32_t i = 1; i + 1 < length; i++) {
+      block->steps[length - 1 + i] = length - 1 - i;
+    }
+    break;
+  case ORDER_SHUFFLE:
+    for (uint32_t i = 0; i < length; i++) {
+      block->steps[i] = i;
+    }
+    // Fisher-Yates
+    for (uint32_t i = length - 1; i > 0; i--) {
+      uint32_t j = order_random_below(o, i + 1);
+      uint32_t tmp = block->steps[i];
+      block->steps[i] = block->steps[j];
+      block->steps[j] = tmp;
+    }
+    // Do not repeat the last step of the previous block
+    if (length > 1 && block->steps[0] == o->last) {
+      uint32_t j = 1 + order_random_below(o, length - 1);
+      block->steps[0] = block->steps[j];
+      block->steps[j] = o->last;
+    }
+    break;
+  case ORDER_WEIGHTED:
+    for (uint32_t i = 0; i < length; i++) {
+      block->steps[i] = order_pick_weighted(o);
+      o->last = block->steps[i];
+    }
+    break;
+  }
+
+  o->last = block->steps[block->length - 1];
+  atomic_store_explicit(&block->ready, true, memory_order_release);
+}
+
+static uint32_t order_block_length(OrderMode mode, size_t length) {
+  if (mode == ORDER_PINGPONG && length > 2) {
+    return (uint32_t)(2 * length - 2);
+  }
+  return (uint32_t)length;
+}
+
+static void order_count_transition(void *userdata, uint32_t step,
+                                   double weight) {
+  (*(size_t *)userdata)++;
+}
+
+// Transitions given by the `next=` options of `sequence`
+static size_t order_count_transitions(const Data *data,
+                                      const Sequence *sequence) {
+  size_t n = 0;
+  for (size_t i = 0; i < sequence->length; i++) {
+    const char *spec = data->step_sequence_next[sequence->first + i];
+    if (spec) {
+      parse_transitions(data, sequence, spec, order_count_transition, &n);
+    }
+  }
+  return n;
+}
+
+static void order_add_transition(void *userdata, uint32_t step,
+                                 double weight) {
+  order *o = userdata;
+  uint32_t at = o->row_first[o->sequence->length]++;
+  o->row_steps[at] = step;
+  o->row_cumulative[at] = weight;
+}
+
+// Fills the tables `order_pick_weighted` draws from. The `next=` options
+// were checked when the steps were loaded.
+static void order_build_chain(order *o, const Data *data) {
+  const Sequence *sequence = o->sequence;
+  double sum = 0.0;
+
+  // Rows are appended in step order, `row_first[length]` being the end
+  o->row_first[sequence->length] = 0;
+  for (size_t i = 0; i < sequence->length; i++) {
+    size_t step = sequence->first + i;
+    sum += data->step_sequence_weight[step];
+    o->cumulative[i] = sum;
+
+    uint32_t first = o->row_first[sequence->length];
+    o->row_first[i] = first;
+    if (data->step_sequence_next[step]) {
+      parse_transitions(data, sequence, data->step_sequence_next[step],
+                        order_add_transition, o);
+    }
+    for (uint32_t k = first + 1; k < o->row_first[sequence->length]; k++) {
+      o->row_cumulative[k] += o->row_cumulative[k - 1];
+    }
+  }
+}
+
+// Sets up the orders of every sequence of `data`, with their blocks and
+// tables in a single allocation. Returns NULL if out of memory.
+order *orders_create(const Data *data, OrderMode mode, uint64_t seed) {
+  size_t total = 0;
+  size_t transitions = 0;
+  size_t steps_total = 0;
+  for (size_t i = 0; i < data->sequence_count; i++) {
+    const Sequence *sequence = &data->sequences[i];
+    total += 2 * order_block_length(mode, sequence->length);
+    if (mode == ORDER_WEIGHTED) {
+      transitions += order_count_transitions(data, sequence);
+    }
+    steps_total += sequence->length;
+  }
+
+  // Laid out from the strictest alignment down
+  size_t chain_steps = mode == ORDER_WEIGHTED ? steps_total : 0;
+  size_t rows = mode == ORDER_WEIGHTED ? steps_total + data->sequence_count : 0;
+  size_t doubles = chain_steps + transitions;
+  size_t words = total + rows + transitions;
+  order *orders = (order *)calloc(data->sequence_count, sizeof(order));
+  char *memory =
+      (char *)malloc(doubles * sizeof(double) + words * sizeof(uint32_t));
+  if (!orders || !memory) {
+    free(orders);
+    free(memory);
+    return NULL;
+  }
+
+  double *reals = (double *)memory;
+  uint32_t *steps = (uint32_t *)(memory + doubles * sizeof(double));
+  orders[0].memory = memory;
+
+  for (size_t i = 0; i < data->sequence_count; i++) {
+    order *o = &orders[i];
+    o->mode = mode;
+    o->sequence = &data->sequences[i];
+    if (mode == ORDER_WEIGHTED) {
+      size_t length = o->sequence->length;
+      size_t n = order_count_transitions(data, o->sequence);
+      o->cumulative = reals;
+      o->row_cumulative = reals + length;
+      reals += length + n;
+      o->row_first = steps;
+      o->row_steps = steps + length + 1;
+      steps += length + 1 + n;
+      order_build_chain(o, data);
+    }
+    // Any non zero state works for xorshift
+    o->rng = (seed + i) * 0x9E3779B97F4A7C15ULL | 1;
+    o->last = UINT32_MAX;
+
+    for (uint32_t b = 0; b < 2; b++) {
+      o->blocks[b].steps = steps;
+      o->blocks[b].length = order_block_length(mode, o->sequence->length);
+      atomic_init(&o->blocks[b].ready, false);
+      steps += o->blocks[b].length;
+      order_generate(o, b);
+    }
+  }
+
+  return orders;
+}
+
+void orders_free(order *orders) {
+  if (orders) {
+    free(orders[0].memory);
+    free(orders);
+  }
+}
+
+// Regenerates every exhausted block. Main loop only.
+void orders_refill(order *orders, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    for (uint32_t b = 0; b < 2; b++) {
+      if (!atomic_load_explicit(&orders[i].blocks[b].ready,
+                                memory_order_acquire)) {
+        order_generate(&orders[i], b);
+      }
+    }
+  }
+}
+
+// Next step to play. Sets `*exhausted` when a block was handed back to the
+// main loop for regeneration. RT-safe.
+static inline uint32_t order_next(order *o, bool *exhausted) {
+  struct order_block *block = &o->blocks[o->current];
+  uint32_t step = block->steps[o->pos++];
+
+  if (o->pos == block->length) {
+    o->pos = 0;
+    uint32_t other = o->current ^ 1;
+    if (atomic_load_explicit(&o->blocks[other].ready, memory_order_acquire)) {
+      atomic_store_explicit(&block->ready, false, memory_order_release);
+      o->current = other;
+      *exhausted = true;
+    }
+  }
+
+  return step;
+}
+
+// Makes `step` the next one returned by `order_next`, for the orders where
+// that means something. Returns false for the random orders, which carry on
+// as they were. RT-safe.
+static inline bool order_seek(order *o, uint32_t step) {
+  if (o->mode == ORDER_LINEAR || o->mode == ORDER_PINGPONG) {
+    o->pos = step;
+    return true;
+  }
+  return false;
+}
+
+// Restarts the current block. RT-safe.
+static inline void order_rewind(order *o) { o->pos = 0; }
+
+// Step `order_next` returns next, without moving past it. Only for when
+// `on_process` is not running.
+static inline uint32_t order_peek(const order *o) {
+  return o->blocks[o->current].steps[o->pos];
+}
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef MBAS_OSC_C
+#define MBAS_OSC_C
+
+#include <endian.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// OSC 1.0 packets, parsed in place.
+//
+// Strings point into the received datagram, which OSC already pads with NUL
+// bytes, and numbers are read as they are iterated, so nothing is copied or
+// allocated.
+
+// Largest datagram read, enough for any controller on a loopback link
+#define OSC_MAX_PACKET 1536
+
+// Bundles nested deeper than this are dropped
+#define OSC_MAX_DEPTH 4
+
+// Time tag meaning "right away"
+#define OSC_IMMEDIATELY 1
+
+// Seconds from the NTP epoch, which time tags count from, to the Unix one
+#define OSC_UNIX_EPOCH 2208988800u
+
+struct osc_message {
+  const char *address;
+  // Type tags, without the leading ','
+  const char *types;
+  // Arguments not iterated yet
+  const uint8_t *args;
+  const uint8_t *end;
+};
+
+typedef struct osc_message osc_message;
+
+struct osc_arg {
+  // Type tag, e.g. 'i' or 'f'
+  char type;
+  union {
+    int32_t i;
+    float f;
+    int64_t h;
+    double d;
+    const char *s;
+  };
+};
+
+typedef struct osc_arg osc_arg;
+
+// Called for each message of a packet, with the time tag of the innermost
+// bundle it is in.
+typedef void (*osc_handler)(void *userdata, osc_message *message,
+                            uint64_t timetag);
+
+// Skips the padded string at `p`. Returns NULL if it does not end before
+// `end`.
+static const uint8_t *osc_skip_string(const uint8_t *p, const uint8_t *end) {
+  const uint8_t *nul = memchr(p, '\0', (size_t)(end - p));
+  if (!nul) {
+    return NULL;
+  }
+  size_t padded = ((size_t)(nul - p) + 4) & ~(size_t)3;
+  return (size_t)(end - p) >= padded ? p + padded : NULL;
+}
+
+static uint32_t osc_read32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return be32toh(value);
+}
+
+static uint64_t osc_read64(const uint8_t *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return be64toh(value);
+}
+
+// Reads the address and the type tags of the message in `buffer`. Returns
+// false if it is malformed.
+static bool osc_parse_message(const uint8_t *buffer, size_t length,
+                              osc_message *m) {
+  const uint8_t *end = buffer + length;
+  if (length == 0 || buffer[0] != '/') {
+    return false;
+  }
+
+  const uint8_t *types = osc_skip_string(buffer, end);
+  if (!types) {
+    return false;
+  }
+  m->address = (const char *)buffer;
+
+  // Old senders may leave out the type tags altogether
+  if (types == end) {
+    m->types = "";
+    m->args = end;
+    m->end = end;
+    return true;
+  }
+  if (*types != ',') {
+    return false;
+  }
+
+  m->args = osc_skip_string(types, end);
+  if (!m->args) {
+    return false;
+  }
+  m->types = (const char *)types + 1;
+  m->end = end;
+  return true;
+}
+
+// Reads the next argument of `m` into `arg`. Returns false when there is none
+// left, or it is malformed or of an unknown type.
+static bool osc_next_arg(osc_message *m, osc_arg *arg) {
+  const uint8_t *p = m->args;
+  size_t left = (size_t)(m->end - p);
+
+  arg->type = *m->types;
+  switch (arg->type) {
+  case 'i':
+  case 'f': {
+    if (left < 4) {
+      return false;
+    }
+    uint32_t bits = osc_read32(p);
+    if (arg->type == 'i') {
+      arg->i = (int32_t)bits;
+    } else {
+      memcpy(&arg->f, &bits, sizeof(arg->f));
+    }
+    p += 4;
+    break;
+  }
+  case 'h':
+  case 'd':
+  case 't': {
+    if (left < 8) {
+      return false;
+    }
+    uint64_t bits = osc_read64(p);
+    if (arg->type == 'd') {
+      memcpy(&arg->d, &bits, sizeof(arg->d));
+    } else {
+      arg->h = (int64_t)bits;
+    }
+    p += 8;
+    break;
+  }
+  case 's':
+  case 'S':
+    arg->s = (const char *)p;
+    p = osc_skip_string(p, m->end);
+    if (!p) {
+      return false;
+    }
+    break;
+  case 'b': {
+    // Skipped, nothing takes a blob
+    if (left < 4) {
+      return false;
+    }
+    size_t padded = ((size_t)osc_read32(p) + 3) & ~(size_t)3;
+    if (padded > left - 4) {
+      return false;
+    }
+    p += 4 + padded;
+    break;
+  }
+  case 'T':
+  case 'F':
+  case 'N':
+  case 'I':
+    break;
+  default:
+    return false;
+  }
+
+  m->types++;
+  m->args = p;
+  return true;
+}
+
+static bool osc_parse_bundle(const uint8_t *buffer, size_t length,
+                             int depth, osc_handler handler, void *userdata);
+
+// Calls `handler` for each message in the packet in `buffer`, a message or a
+// bundle. `timetag` applies to a bare message. Returns false if the packet is
+// malformed, after handling the messages before the malformed part.
+static bool osc_parse_packet(const uint8_t *buffer, size_t length,
+                             uint64_t timetag, int depth, osc_handler handler,
+                             void *userdata) {
+  if (length >= 8 && memcmp(buffer, "#bundle", 8) == 0) {
+    return osc_parse_bundle(buffer, length, depth, handler, userdata);
+  }
+
+  osc_message m;
+  if (!osc_parse_message(buffer, length, &m)) {
+    return false;
+  }
+  handler(userdata, &m, timetag);
+  return true;
+}
+
+static bool osc_parse_bundle(const uint8_t *buffer, size_t length,
+                             int depth, osc_handler handler, void *userdata) {
+  if (depth >= OSC_MAX_DEPTH || length < 16) {
+    return false;
+  }
+
+  uint64_t timetag = osc_read64(buffer + 8);
+  size_t offset = 16;
+  while (offset < length) {
+    if (length - offset < 4) {
+      return false;
+    }
+    uint32_t size = osc_read32(buffer + offset);
+    offset += 4;
+    if (size > length - offset || size % 4 != 0 ||
+        !osc_parse_packet(buffer + offset, size, timetag, depth + 1, handler,
+                          userdata)) {
+      return false;
+    }
+    offset += size;
+  }
+  return true;
+}
+
+// CLOCK_MONOTONIC time of `timetag`, or 0 for OSC_IMMEDIATELY.
+static int64_t osc_timetag_ns(uint64_t timetag) {
+  if (timetag == OSC_IMMEDIATELY) {
+    return 0;
+  }
+
+  int64_t seconds = (int64_t)(timetag >> 32) - OSC_UNIX_EPOCH;
+  int64_t fraction = (int64_t)(((timetag & UINT32_MAX) * 1000000000) >> 32);
+  int64_t realtime = seconds * 1000000000 + fraction;
+
+  struct timespec real, mono;
+  clock_gettime(CLOCK_REALTIME, &real);
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  int64_t at = realtime - ((int64_t)real.tv_sec * 1000000000 + real.tv_nsec) +
+               ((int64_t)mono.tv_sec * 1000000000 + mono.tv_nsec);
+  return at > 0 ? at : 0;
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef MBAS_PROTOCOL_H
+#define MBAS_PROTOCOL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary commands, shared by the daemon and its clients.
+//
+// A PLAY is a fixed size struct instead of text, so sending it to the socket
+// or posting it to a command ring takes a copy and no parsing. Fields are in
+// host byte order, both ends are on the same machine.
+
+enum mbas_command_type {
+  MBAS_COMMAND_PLAY = 1,
+  // Sent back by mbas, see `mbas_ack`
+  MBAS_REPLY_ACK = 2,
+};
+
+// `mbas_command.step` of a PLAY that plays whatever step comes next
+#define MBAS_NEXT_STEP UINT32_MAX
+// `mbas_command.velocity` of a PLAY without `vel=`
+#define MBAS_NO_VELOCITY UINT8_MAX
+
+// `mbas_command.flags`: reply with an `mbas_ack` for `seq`, like `PLAY seq=`.
+// Ignored on command rings.
+#define MBAS_FLAG_ACK 0x1
+
+struct mbas_command {
+  uint8_t type;
+  // 0-127, or MBAS_NO_VELOCITY
+  uint8_t velocity;
+  uint16_t flags;
+  // Index of the step in the selected sequence, or MBAS_NEXT_STEP
+  uint32_t step;
+  // Same ranges as `PLAY rate=` and `PLAY gain=`, 1.0 when not given
+  float rate;
+  float gain;
+  // Chosen by the client, echoed in the ack
+  uint32_t seq;
+  uint32_t reserved;
+  // Same as `PLAY at=`, 0 to play right away. At most 10 s past the latency.
+  int64_t at_ns;
+};
+
+// What became of an acknowledged PLAY
+enum mbas_ack_result {
+  // Plays right away
+  MBAS_ACK_ACCEPTED = 0,
+  // Plays after the PLAYs queued before it
+  MBAS_ACK_QUEUED = 1,
+  // The queue was full, see `queue.overflow`
+  MBAS_ACK_DROPPED = 2,
+  // Folded into a queued PLAY as a skipped step, see `queue.overflow`
+  MBAS_ACK_COALESCED = 3,
+  MBAS_ACK_INVALID = 4,
+};
+
+// Reply to a binary PLAY with MBAS_FLAG_ACK
+struct mbas_ack {
+  // MBAS_REPLY_ACK
+  uint8_t type;
+  // One of `mbas_ack_result`
+  uint8_t result;
+  uint16_t reserved;
+  uint32_t seq;
+  // When the step is expected to be heard, in CLOCK_MONOTONIC nanoseconds.
+  // 0 if it is not played.
+  int64_t time_ns;
+  // Output latency of the stream, see LATENCY
+  int64_t latency_ns;
+};
+
+// Whether the datagram `buffer`, `n` bytes long, holds a binary command. Text
+// commands start with a letter, which is never a valid `type`.
+static inline bool mbas_is_binary_command(const void *buffer, size_t n) {
+  return n == sizeof(struct mbas_command) &&
+         *(const uint8_t *)buffer == MBAS_COMMAND_PLAY;
+}
+
+// Ring of commands in shared memory, with the client as the only producer
+// and the audio thread of the daemon as the only consumer.
+//
+// A bound client sends `RING` to the socket and gets back the memfd holding
+// the ring and an eventfd. To post, it writes `commands[tail % slots]` and
+// then increments `tail`. If `sleeping` is set afterwards, the daemon is not
+// polling and the client writes 1 to the eventfd to wake it up.
+#define MBAS_RING_MAGIC 0x676e6972 // "ring"
+#define MBAS_RING_VERSION 3
+#define MBAS_RING_SLOTS 256
+
+struct mbas_ring {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t reserved;
+
+  // Written by the client
+  _Alignas(64) _Atomic uint32_t tail;
+
+  // Written by the daemon
+  _Alignas(64) _Atomic uint32_t head;
+  _Atomic uint32_t sleeping;
+
+  _Alignas(64) struct mbas_command commands[MBAS_RING_SLOTS];
+};
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef MBAS_QUEUE_C
+#define MBAS_QUEUE_C
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "config.c"
+
+// `trigger.step` of a PLAY that plays whatever step comes next
+#define TRIGGER_NEXT_STEP SIZE_MAX
+
+// A pending PLAY.
+struct trigger {
+  // Step to jump to, or TRIGGER_NEXT_STEP
+  size_t step;
+  // Sequence `step` was resolved against, which may have been switched away
+  // from by the time the trigger is popped
+  size_t sequence;
+  // Steps to skip before playing this one (filled in by the consumer when
+  // triggers were coalesced).
+  uint32_t skip;
+  // Multiplies the playback rate of the step
+  float rate;
+  float gain;
+  // When the step should be heard, in CLOCK_MONOTONIC nanoseconds, or 0 for
+  // right away
+  int64_t at_ns;
+};
+
+typedef struct trigger trigger;
+
+// Single producer (main loop, `on_msg`), single consumer (`on_process`)
+// lock-free ring of pending triggers.
+//
+// The ring is bigger than `depth` so that `OVERFLOW_DROP_OLDEST` can push
+// first and let the consumer discard the oldest entries, since the producer
+// must never move `head` itself.
+struct trigger_queue {
+  trigger *slots;
+  uint32_t mask;
+  uint32_t depth;
+  Overflow overflow;
+
+  _Atomic uint32_t head;
+  _Atomic uint32_t tail;
+
+  // Oldest entries the consumer has to discard before its next pop.
+  _Atomic uint32_t evict;
+  // Triggers folded into the next popped entry as skipped steps.
+  _Atomic uint32_t coalesce;
+
+  _Atomic uint64_t dropped;
+  _Atomic uint64_t coalesced;
+};
+
+typedef struct trigger_queue trigger_queue;
+
+enum {
+  TRIGGER_QUEUED = 0,
+  TRIGGER_DROPPED = 1,
+  TRIGGER_COALESCED = 2,
+};
+
+bool trigger_queue_init(trigger_queue *q, uint32_t depth, Overflow overflow) {
+  uint32_t capacity = 2;
+  while (capacity < 2 * depth) {
+    capacity <<= 1;
+  }
+
+  q->slots = (trigger *)calloc(capacity, sizeof(trigger));
+  if (!q->slots) {
+    return false;
+  }
+
+  q->mask = capacity - 1;
+  q->depth = depth;
+  q->overflow = overflow;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  atomic_init(&q->evict, 0);
+  atomic_init(&q->coalesce, 0);
+  atomic_init(&q->dropped, 0);
+  atomic_init(&q->coalesced, 0);
+  return true;
+}
+
+void trigger_queue_free(trigger_queue *q) {
+  free(q->slots);
+  q->slots = NULL;
+}
+
+// Amount of triggers waiting to be played.
+uint32_t trigger_queue_pending(trigger_queue *q) {
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  uint32_t evict = atomic_load_explicit(&q->evict, memory_order_relaxed);
+  uint32_t used = tail - head;
+  return used > evict ? used - evict : 0;
+}
+
+// Producer side. Returns one of TRIGGER_QUEUED, TRIGGER_DROPPED or
+// TRIGGER_COALESCED.
+int trigger_queue_push(trigger_queue *q, const trigger *t) {
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+  if (trigger_queue_pending(q) >= q->depth) {
+    switch (q->overflow) {
+    case OVERFLOW_DROP_NEWEST:
+      atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+      return TRIGGER_DROPPED;
+    case OVERFLOW_COALESCE:
+      atomic_fetch_add_explicit(&q->coalesce, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&q->coalesced, 1, memory_order_relaxed);
+      return TRIGGER_COALESCED;
+    case OVERFLOW_DROP_OLDEST:
+      // The consumer is stalled and the slack is used up, nothing to evict
+      // into.
+      if (tail - head > q->mask) {
+        atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+        return TRIGGER_DROPPED;
+      }
+      atomic_fetch_add_explicit(&q->evict, 1, memory_order_relaxed);
+      break;
+    }
+  }
+
+  q->slots[tail & q->mask] = *t;
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+  return TRIGGER_QUEUED;
+}
+
+// Consumer side, RT-safe. Copies the trigger `trigger_queue_pop` would
+// return, without removing it. Returns false if there is nothing to play.
+bool trigger_queue_peek(trigger_queue *q, trigger *t) {
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  uint32_t evict = atomic_load_explicit(&q->evict, memory_order_relaxed);
+  if (tail - head <= evict) {
+    return false;
+  }
+
+  *t = q->slots[(head + evict) & q->mask];
+  return true;
+}
+
+// Consumer side, RT-safe. Returns false if there is nothing to play.
+bool trigger_queue_pop(trigger_queue *q, trigger *t) {
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+  uint32_t evict = atomic_exchange_explicit(&q->evict, 0, memory_order_relaxed);
+  if (evict > tail - head) {
+    evict = tail - head;
+  }
+  if (evict > 0) {
+    head += evict;
+    atomic_fetch_add_explicit(&q->dropped, evict, memory_order_relaxed);
+  }
+
+  if (head == tail) {
+    atomic_store_explicit(&q->head, head, memory_order_release);
+    return false;
+  }
+
+  *t = q->slots[head & q->mask];
+  t->skip += atomic_exchange_explicit(&q->coalesce, 0, memory_order_relaxed);
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return true;
+}
+
+#endif
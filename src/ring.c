@@ -0,0 +1,166 @@
+#ifndef MBAS_RING_C
+#define MBAS_RING_C
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+// Daemon side of the command rings, see `mbas_ring` in protocol.h.
+
+#define MAX_RINGS 16
+
+// Lifetime of a ring, as seen by both threads. The main loop only unmaps a
+// closing ring once `on_process` acknowledged it, or provably is not using
+// it, see `close_ring` in main.c.
+enum {
+  RING_FREE = 0,
+  RING_ACTIVE = 1,
+  RING_CLOSING = 2,
+  RING_CLOSED = 3,
+};
+
+struct command_ring {
+  _Atomic int state;
+  struct mbas_ring *ring;
+  // Kept to hand the ring over on an upgrade
+  int memfd;
+  int eventfd;
+  // Process that asked for the ring, and a pidfd to notice it exit. -1 on
+  // kernels without pidfd_open.
+  pid_t owner;
+  int owner_fd;
+};
+
+typedef struct command_ring command_ring;
+
+// Maps a new ring in `r`, whose `memfd` the client is handed along with its
+// `eventfd`. Returns false on failure.
+bool command_ring_create(command_ring *r) {
+  r->memfd = memfd_create("mbas-ring", MFD_CLOEXEC);
+  if (r->memfd < 0) {
+    perror("memfd_create");
+    return false;
+  }
+
+  if (ftruncate(r->memfd, sizeof(struct mbas_ring)) < 0) {
+    perror("ftruncate");
+    goto close_memfd;
+  }
+
+  r->ring = (struct mbas_ring *)mmap(NULL, sizeof(struct mbas_ring),
+                                     PROT_READ | PROT_WRITE, MAP_SHARED,
+                                     r->memfd, 0);
+  if (r->ring == MAP_FAILED) {
+    perror("mmap");
+    goto close_memfd;
+  }
+
+  r->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (r->eventfd < 0) {
+    perror("eventfd");
+    munmap(r->ring, sizeof(struct mbas_ring));
+    goto close_memfd;
+  }
+
+  r->ring->magic = MBAS_RING_MAGIC;
+  r->ring->version = MBAS_RING_VERSION;
+  r->ring->slots = MBAS_RING_SLOTS;
+  atomic_init(&r->ring->tail, 0);
+  atomic_init(&r->ring->head, 0);
+  // Whether the stream runs or not, the first wake-up is cheap
+  atomic_init(&r->ring->sleeping, 1);
+  return true;
+
+close_memfd:
+  close(r->memfd);
+  r->memfd = -1;
+  return false;
+}
+
+// Maps the ring the previous process handed over, see `upgrade` in main.c.
+// Takes `memfd` and `eventfd`. Returns false, after closing them, if it is
+// not a ring of this version.
+bool command_ring_adopt(command_ring *r, int memfd, int eventfd) {
+  r->memfd = memfd;
+  r->eventfd = eventfd;
+  struct stat st;
+  r->ring = fstat(memfd, &st) == 0 &&
+                    (size_t)st.st_size >= sizeof(struct mbas_ring)
+                ? (struct mbas_ring *)mmap(NULL, sizeof(struct mbas_ring),
+                                           PROT_READ | PROT_WRITE, MAP_SHARED,
+                                           memfd, 0)
+                : MAP_FAILED;
+  if (r->ring != MAP_FAILED && r->ring->magic == MBAS_RING_MAGIC &&
+      r->ring->version == MBAS_RING_VERSION &&
+      r->ring->slots == MBAS_RING_SLOTS) {
+    fcntl(memfd, F_SETFD, FD_CLOEXEC);
+    fcntl(eventfd, F_SETFD, FD_CLOEXEC);
+    return true;
+  }
+
+  if (r->ring != MAP_FAILED) {
+    munmap(r->ring, sizeof(struct mbas_ring));
+  }
+  close(memfd);
+  close(eventfd);
+  r->ring = NULL;
+  r->memfd = -1;
+  r->eventfd = -1;
+  return false;
+}
+
+void command_ring_destroy(command_ring *r) {
+  munmap(r->ring, sizeof(struct mbas_ring));
+  close(r->memfd);
+  close(r->eventfd);
+  r->ring = NULL;
+  r->memfd = -1;
+  r->eventfd = -1;
+}
+
+// Commands waiting. The client owns `tail`, so this is clamped to the ring.
+static inline uint32_t command_ring_pending(const command_ring *r) {
+  uint32_t head = atomic_load_explicit(&r->ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&r->ring->tail, memory_order_acquire);
+  uint32_t pending = tail - head;
+  return pending > MBAS_RING_SLOTS ? MBAS_RING_SLOTS : pending;
+}
+
+// Consumer side, RT-safe. Returns false if the ring is empty.
+static inline bool command_ring_pop(command_ring *r, struct mbas_command *c) {
+  uint32_t head = atomic_load_explicit(&r->ring->head, memory_order_relaxed);
+  if (command_ring_pending(r) == 0) {
+    return false;
+  }
+
+  *c = r->ring->commands[head % MBAS_RING_SLOTS];
+  atomic_store_explicit(&r->ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+// Tells the client to write to the eventfd after posting, from now on.
+// Returns false, and stays awake, if a command was posted meanwhile. Pairs
+// with the client reading `sleeping` after moving `tail`.
+bool command_ring_sleep(command_ring *r) {
+  atomic_store(&r->ring->sleeping, 1);
+  if (atomic_load(&r->ring->tail) != atomic_load(&r->ring->head)) {
+    atomic_store(&r->ring->sleeping, 0);
+    return false;
+  }
+  return true;
+}
+
+void command_ring_wake(command_ring *r) {
+  atomic_store_explicit(&r->ring->sleeping, 0, memory_order_relaxed);
+}
+
+#endif
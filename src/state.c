@@ -0,0 +1,197 @@
+#ifndef MBAS_STATE_C
+#define MBAS_STATE_C
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.c"
+#include "data.c"
+
+// Playback position kept in a small mapped file, see `state.path`.
+//
+// `on_process` updates it with a single store per step, to memory of the
+// process: a store to the mapping could fault, since the page is write
+// protected again after each msync. A background thread copies it to the
+// mapping and msyncs it every STATE_SYNC_SECONDS, so it survives crashes and
+// reboots, at most that late.
+#define STATE_MAGIC 0x74736d62 // "bmst"
+#define STATE_VERSION 1
+#define STATE_SYNC_SECONDS 5
+
+// `position` when nothing was played yet
+#define STATE_NO_POSITION UINT64_MAX
+
+struct state_file {
+  uint32_t magic;
+  uint32_t version;
+  // Identifies the sequences the position refers to, see `state_key`
+  uint64_t key;
+  // Sequence index in the high half, step in the low one
+  _Atomic uint64_t position;
+};
+
+struct persistent_state {
+  struct state_file *file;
+  // Stored by `on_process`, copied to `file` by `state_sync`
+  _Atomic uint64_t position;
+  pthread_t sync_thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  bool stop;
+};
+
+typedef struct persistent_state persistent_state;
+
+// Hash of the name and length of every sequence, so a position is not
+// resumed into sequences that changed shape.
+static uint64_t state_key(const Data *data) {
+  uint64_t key = CACHE_KEY_INIT;
+  for (size_t i = 0; i < data->sequence_count; i++) {
+    const Sequence *sequence = &data->sequences[i];
+    key = cache_key_add(key, sequence->name, strlen(sequence->name) + 1);
+    key = cache_key_add(key, &sequence->length, sizeof(sequence->length));
+  }
+  return key;
+}
+
+// Copies the position to the file and syncs it, if it changed since
+// `*synced`.
+static void state_flush(persistent_state *state, uint64_t *synced) {
+  uint64_t position =
+      atomic_load_explicit(&state->position, memory_order_relaxed);
+  if (position != *synced) {
+    atomic_store_explicit(&state->file->position, position,
+                          memory_order_relaxed);
+    msync(state->file, sizeof(struct state_file), MS_SYNC);
+    *synced = position;
+  }
+}
+
+static void *state_sync(void *userdata) {
+  persistent_state *state = userdata;
+  uint64_t synced = atomic_load(&state->file->position);
+
+  pthread_mutex_lock(&state->lock);
+  while (!state->stop) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += STATE_SYNC_SECONDS;
+    pthread_cond_timedwait(&state->wake, &state->lock, &until);
+    state_flush(state, &synced);
+  }
+  pthread_mutex_unlock(&state->lock);
+  return NULL;
+}
+
+// Maps the state file at `path`, creating it if needed, and starts syncing
+// it. A file left for other sequences than the ones in `data` is reset.
+// Returns false, after printing why, on failure.
+bool state_open(persistent_state *state, const char *path, const Data *data) {
+  state->file = NULL;
+
+  char dir[4096];
+  snprintf(dir, sizeof(dir), "%s", path);
+  char *slash = strrchr(dir, '/');
+  if (slash && slash != dir) {
+    *slash = '\0';
+    cache_mkdir(dir);
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0 || ftruncate(fd, sizeof(struct state_file)) < 0) {
+    fprintf(stderr, "Failed to open state file: %s\n", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+
+  void *map = mmap(NULL, sizeof(struct state_file), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Failed to map state file: %s\n", path);
+    return false;
+  }
+
+  struct state_file *file = map;
+  uint64_t key = state_key(data);
+  if (file->magic != STATE_MAGIC || file->version != STATE_VERSION ||
+      file->key != key) {
+    file->magic = STATE_MAGIC;
+    file->version = STATE_VERSION;
+    file->key = key;
+    atomic_store(&file->position, STATE_NO_POSITION);
+  }
+
+  state->file = file;
+  atomic_store(&state->position, atomic_load(&file->position));
+  state->stop = false;
+  pthread_mutex_init(&state->lock, NULL);
+  pthread_cond_init(&state->wake, NULL);
+  if (pthread_create(&state->sync_thread, NULL, state_sync, state) != 0) {
+    fprintf(stderr, "Failed to start syncing the state file, it is only "
+                    "written on exit\n");
+    state->stop = true;
+  }
+  return true;
+}
+
+// Position stored by the previous run. Returns false if there is none.
+bool state_position(const persistent_state *state, size_t *sequence,
+                    size_t *step) {
+  if (!state->file) {
+    return false;
+  }
+
+  uint64_t position = atomic_load(&state->file->position);
+  if (position == STATE_NO_POSITION) {
+    return false;
+  }
+  *sequence = (size_t)(position >> 32);
+  *step = (size_t)(position & UINT32_MAX);
+  return true;
+}
+
+// Records that `step` of `sequence` is being played. RT-safe.
+static inline void state_store(persistent_state *state, size_t sequence,
+                               size_t step) {
+  if (state->file) {
+    atomic_store_explicit(&state->position,
+                          (uint64_t)sequence << 32 | (uint32_t)step,
+                          memory_order_relaxed);
+  }
+}
+
+// Stops the sync thread, syncs one last time and unmaps the file.
+void state_close(persistent_state *state) {
+  if (!state->file) {
+    return;
+  }
+
+  pthread_mutex_lock(&state->lock);
+  bool running = !state->stop;
+  state->stop = true;
+  pthread_cond_signal(&state->wake);
+  pthread_mutex_unlock(&state->lock);
+  if (running) {
+    pthread_join(state->sync_thread, NULL);
+  }
+
+  uint64_t synced = atomic_load(&state->file->position);
+  state_flush(state, &synced);
+  munmap(state->file, sizeof(struct state_file));
+  pthread_mutex_destroy(&state->lock);
+  pthread_cond_destroy(&state->wake);
+  state->file = NULL;
+}
+
+#endif
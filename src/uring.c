@@ -0,0 +1,289 @@
+#ifndef MBAS_URING_C
+#define MBAS_URING_C
+
+#ifdef MBAS_WITH_IO_URING
+
+#include <errno.h>
+#include <liburing.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Datagram socket receive with io_uring.
+//
+// A single multishot recvmsg stays armed on the socket, and the kernel fills
+// buffers taken from a ring it shares with us, so each datagram costs no
+// syscall: the loop wakes up on the io_uring fd and reads the completions.
+// Buffers are handed back as soon as their datagram is handled.
+
+// Buffers in the ring, a power of two
+#define URING_BUFFERS 64
+
+// Buffer group of the ring
+#define URING_BUFFER_GROUP 0
+
+// `user_data` of the submissions, to tell their completions apart
+#define URING_RECV 1
+#define URING_CANCEL 2
+
+// Largest datagram read, as in `on_msg`
+#define URING_MAX_DATAGRAM 256
+
+// Room for the sender address, rounded so the control data after it is
+// aligned for `struct cmsghdr`
+#define URING_NAME_SIZE                                                        \
+  ((sizeof(struct sockaddr_un) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1))
+
+#define URING_CONTROL_SIZE CMSG_SPACE(sizeof(struct ucred))
+
+// Header, address, control data and payload, as the kernel lays them out.
+// Longer datagrams are truncated. One more byte is kept past what the kernel
+// is told, to NUL terminate the payload.
+#define URING_BUFFER_SIZE                                                      \
+  (sizeof(struct io_uring_recvmsg_out) + URING_NAME_SIZE +                     \
+   URING_CONTROL_SIZE + URING_MAX_DATAGRAM + 1)
+
+struct datagram {
+  // NUL terminated
+  char *payload;
+  size_t length;
+  struct sockaddr_un *addr;
+  socklen_t addr_len;
+  // Only the control data is set, for CMSG_FIRSTHDR
+  struct msghdr control;
+};
+
+typedef struct datagram datagram;
+
+typedef void (*datagram_handler)(void *userdata, datagram *d);
+
+struct datagram_uring {
+  struct io_uring ring;
+  struct io_uring_buf_ring *buffers;
+  uint8_t *memory;
+  // Tells the kernel how much room the address and control data get
+  struct msghdr msg;
+  int fd;
+  // Whether the receive is submitted and not ended yet
+  bool armed;
+  // Set by `datagram_uring_stop`, so the receive is not re-armed
+  bool stopping;
+};
+
+typedef struct datagram_uring datagram_uring;
+
+// Fd to poll for completions
+static inline int datagram_uring_fd(const datagram_uring *u) {
+  return u->ring.ring_fd;
+}
+
+static uint8_t *datagram_uring_buffer(datagram_uring *u, unsigned id) {
+  return u->memory + (size_t)id * URING_BUFFER_SIZE;
+}
+
+static void datagram_uring_recycle(datagram_uring *u, unsigned id,
+                                   int offset) {
+  io_uring_buf_ring_add(u->buffers, datagram_uring_buffer(u, id),
+                        URING_BUFFER_SIZE - 1, (unsigned short)id,
+                        io_uring_buf_ring_mask(URING_BUFFERS), offset);
+}
+
+// Submits the multishot recvmsg. It stays armed until the kernel ends it, on
+// an error or when it runs out of buffers.
+static bool datagram_uring_arm(datagram_uring *u) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+  if (!sqe) {
+    fprintf(stderr, "io_uring submission queue full\n");
+    return false;
+  }
+  io_uring_prep_recvmsg_multishot(sqe, u->fd, &u->msg, 0);
+  io_uring_sqe_set_data64(sqe, URING_RECV);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+
+  int res = io_uring_submit(&u->ring);
+  if (res < 0) {
+    fprintf(stderr, "io_uring_submit: %s\n", strerror(-res));
+    return false;
+  }
+  u->armed = true;
+  return true;
+}
+
+// Starts receiving from the datagram socket `fd`. Returns false if io_uring,
+// provided buffer rings or multishot recvmsg are not available, so the
+// caller can read the socket itself instead.
+static inline bool datagram_uring_init(datagram_uring *u, int fd) {
+  u->fd = fd;
+  u->armed = false;
+  u->stopping = false;
+  u->msg = (struct msghdr){
+      .msg_namelen = URING_NAME_SIZE,
+      .msg_controllen = URING_CONTROL_SIZE,
+  };
+
+  // Room for a completion per buffer, the one ending the receive and the
+  // one of its cancellation, so they never overflow into the kernel
+  struct io_uring_params params = {
+      .flags = IORING_SETUP_CQSIZE,
+      .cq_entries = 2 * URING_BUFFERS,
+  };
+  int res = io_uring_queue_init_params(8, &u->ring, &params);
+  if (res < 0) {
+    fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-res));
+    return false;
+  }
+
+  u->memory = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+  if (!u->memory) {
+    fprintf(stderr, "Failed to allocate io_uring buffers\n");
+    goto exit_queue;
+  }
+
+  u->buffers = io_uring_setup_buf_ring(&u->ring, URING_BUFFERS,
+                                       URING_BUFFER_GROUP, 0, &res);
+  if (!u->buffers) {
+    fprintf(stderr, "io_uring_setup_buf_ring: %s\n", strerror(-res));
+    goto free_memory;
+  }
+  for (unsigned i = 0; i < URING_BUFFERS; i++) {
+    datagram_uring_recycle(u, i, (int)i);
+  }
+  io_uring_buf_ring_advance(u->buffers, URING_BUFFERS);
+
+  if (!datagram_uring_arm(u)) {
+    goto free_buffers;
+  }
+  return true;
+
+free_buffers:
+  io_uring_free_buf_ring(&u->ring, u->buffers, URING_BUFFERS,
+                         URING_BUFFER_GROUP);
+free_memory:
+  free(u->memory);
+exit_queue:
+  io_uring_queue_exit(&u->ring);
+  return false;
+}
+
+static inline void datagram_uring_free(datagram_uring *u) {
+  io_uring_free_buf_ring(&u->ring, u->buffers, URING_BUFFERS,
+                         URING_BUFFER_GROUP);
+  io_uring_queue_exit(&u->ring);
+  free(u->memory);
+}
+
+// Calls `handler` for each datagram received, then gives the buffers back
+// and re-arms the receive if the kernel ended it. Returns false if the
+// receive failed for good, e.g. a kernel without multishot recvmsg, after
+// which nothing more is received.
+static inline bool datagram_uring_drain(datagram_uring *u,
+                                        datagram_handler handler,
+                                        void *userdata) {
+  struct io_uring_cqe *cqe;
+  unsigned head;
+  unsigned seen = 0;
+  int recycled = 0;
+  bool failed = false;
+
+  io_uring_for_each_cqe(&u->ring, head, cqe) {
+    seen++;
+    if (io_uring_cqe_get_data64(cqe) != URING_RECV) {
+      continue;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      u->armed = false;
+    }
+    if (cqe->res < 0) {
+      // Out of buffers ends the receive until some are given back, and
+      // `datagram_uring_stop` ends it on purpose
+      if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        fprintf(stderr, "io_uring recvmsg: %s\n", strerror(-cqe->res));
+        failed = cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP;
+      }
+      continue;
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+      continue;
+    }
+
+    unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    uint8_t *buffer = datagram_uring_buffer(u, id);
+    struct io_uring_recvmsg_out *out =
+        io_uring_recvmsg_validate(buffer, cqe->res, &u->msg);
+    if (out) {
+      datagram d = {
+          .payload = io_uring_recvmsg_payload(out, &u->msg),
+          .length = io_uring_recvmsg_payload_length(out, cqe->res, &u->msg),
+          .addr = io_uring_recvmsg_name(out),
+          .addr_len = out->namelen,
+          .control =
+              {
+                  .msg_control = (uint8_t *)io_uring_recvmsg_name(out) +
+                                 u->msg.msg_namelen,
+                  .msg_controllen = out->controllen,
+              },
+      };
+      d.payload[d.length] = '\0';
+      handler(userdata, &d);
+    }
+    datagram_uring_recycle(u, id, recycled++);
+  }
+
+  io_uring_buf_ring_advance(u->buffers, recycled);
+  io_uring_cq_advance(&u->ring, seen);
+  // Completions the queue had no room for are only moved to it on request,
+  // and leave the fd readable meanwhile
+  if (io_uring_cq_has_overflow(&u->ring)) {
+    io_uring_get_events(&u->ring);
+  }
+  if (failed) {
+    return false;
+  }
+  return u->armed || u->stopping || datagram_uring_arm(u);
+}
+
+// Cancels the receive and handles the datagrams it read meanwhile, so the
+// next ones wait in the socket, e.g. for another process to read them.
+static inline void datagram_uring_stop(datagram_uring *u,
+                                       datagram_handler handler,
+                                       void *userdata) {
+  u->stopping = true;
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+  if (!sqe) {
+    fprintf(stderr, "io_uring submission queue full\n");
+    return;
+  }
+  io_uring_prep_cancel64(sqe, URING_RECV, 0);
+  io_uring_sqe_set_data64(sqe, URING_CANCEL);
+  int res = io_uring_submit(&u->ring);
+  if (res < 0) {
+    fprintf(stderr, "io_uring_submit: %s\n", strerror(-res));
+    return;
+  }
+
+  while (u->armed) {
+    struct io_uring_cqe *cqe;
+    res = io_uring_wait_cqe(&u->ring, &cqe);
+    if (res < 0) {
+      fprintf(stderr, "io_uring_wait_cqe: %s\n", strerror(-res));
+      return;
+    }
+    datagram_uring_drain(u, handler, userdata);
+  }
+}
+
+// Re-arms the receive after `datagram_uring_stop`. Returns false if it
+// failed.
+static inline bool datagram_uring_resume(datagram_uring *u) {
+  u->stopping = false;
+  return u->armed || datagram_uring_arm(u);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef MBAS_VOICE_C
+#define MBAS_VOICE_C
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "data.c"
+#include "dsp.c"
+
+// WSOLA parameters, in frames. A grain is `STRETCH_WINDOW` long and grains are
+// laid out every `STRETCH_HOP` frames of output. Each grain is looked for up
+// to `STRETCH_SEEK` frames away from its nominal input position.
+#define STRETCH_WINDOW 1024
+#define STRETCH_HOP (STRETCH_WINDOW / 2)
+#define STRETCH_SEEK 128
+
+// Frames resampled at once. Blocks touching the edges of the step, or of an
+// encoded sample, are resampled from a zero padded copy of that part of the
+// step.
+#define RESAMPLE_BLOCK 64
+#define RESAMPLE_PAD (SINC_TAPS / 2 * (size_t)MAX_PLAYBACK_RATE)
+#define RESAMPLE_SPAN                                                          \
+  (RESAMPLE_BLOCK * (size_t)MAX_PLAYBACK_RATE + 2 * RESAMPLE_PAD + 2)
+
+// Output fade-in of the grains. Shared by every voice, see `voice_init`.
+static float stretch_rise[STRETCH_HOP];
+static float stretch_fall[STRETCH_HOP];
+
+static Interpolation voice_interpolation = INTERP_CUBIC;
+
+// One step being rendered.
+//
+// Positions are relative to the start of the step and in frames of the step
+// as heard at `rate`.
+struct voice {
+  // Step range in the sample, [start, end)
+  size_t start;
+  size_t end;
+  // Sample frames per output frame
+  double rate;
+  // Length of the step at `rate`
+  size_t length;
+  // Output frames left to render
+  size_t left;
+  float gain;
+
+  // Output length / `length`. 1 plays the step as is.
+  double ratio;
+
+  // Unstretched playback
+  size_t pos;
+
+  // Stretched playback (WSOLA)
+  double nominal;
+  int64_t prev;
+  uint32_t ready_pos;
+  float ready[STRETCH_HOP];
+  float tail[STRETCH_HOP];
+  float ref[STRETCH_HOP];
+  float seg[STRETCH_WINDOW + 2 * STRETCH_SEEK];
+
+  float pad[RESAMPLE_SPAN];
+};
+
+typedef struct voice voice;
+
+void voice_init(Interpolation interpolation) {
+  voice_interpolation = interpolation;
+  dsp_init_sinc_table();
+  dsp_hann_rise(stretch_rise, STRETCH_HOP);
+  for (size_t i = 0; i < STRETCH_HOP; i++) {
+    stretch_fall[i] = 1.0f - stretch_rise[i];
+  }
+}
+
+// Reads `n` frames at `pos` scaled by `gain`, all of them inside the step.
+static void voice_read(voice *v, const Data *data, size_t pos, size_t n,
+                       float gain, float *out) {
+  if (v->rate == 1.0) {
+    if (data->sample) {
+      dsp_scale(out, &data->sample[v->start + pos], gain, n);
+    } else {
+      sample_decode(data, v->start + pos, n, out);
+      dsp_scale(out, out, gain, n);
+    }
+    return;
+  }
+
+  int before, after;
+  dsp_reach(voice_interpolation, v->rate, &before, &after);
+  int64_t start = (int64_t)v->start;
+  int64_t end = (int64_t)v->end;
+
+  for (size_t done = 0; done < n; done += RESAMPLE_BLOCK) {
+    size_t block = SPA_MIN(n - done, RESAMPLE_BLOCK);
+    double first = (double)(pos + done) * v->rate;
+    double last = (double)(pos + done + block - 1) * v->rate;
+    int64_t from = start + (int64_t)first - before;
+    int64_t to = start + (int64_t)last + after + 1;
+
+    if (data->sample && from >= start && to <= end) {
+      dsp_resample(voice_interpolation, out + done, data->sample,
+                   (double)start + first, v->rate, gain, block);
+      continue;
+    }
+
+    // Near the edges, the kernel reads silence outside the step. Encoded
+    // samples are always decoded here first.
+    int64_t copy_from = SPA_MAX(from, start);
+    int64_t copy_to = SPA_MIN(to, end);
+    memset(v->pad, 0, (to - from) * sizeof(float));
+    if (copy_from < copy_to) {
+      sample_decode(data, (size_t)copy_from, (size_t)(copy_to - copy_from),
+                    v->pad + (copy_from - from));
+    }
+    dsp_resample(voice_interpolation, out + done, v->pad,
+                 first - (double)(from - start), v->rate, gain, block);
+  }
+}
+
+// Copies `n` frames starting at `pos` into `out`. Frames outside the step
+// read as silence.
+static void voice_fetch(voice *v, const Data *data, int64_t pos, size_t n,
+                        float *out) {
+  int64_t from = SPA_MAX(pos, 0);
+  int64_t to = SPA_MIN(pos + (int64_t)n, (int64_t)v->length);
+
+  if (from >= to) {
+    memset(out, 0, n * sizeof(float));
+    return;
+  }
+
+  memset(out, 0, (from - pos) * sizeof(float));
+  voice_read(v, data, (size_t)from, (size_t)(to - from), 1.0f,
+             out + (from - pos));
+  memset(out + (to - pos), 0, (pos + (int64_t)n - to) * sizeof(float));
+}
+
+// Computes the next `STRETCH_HOP` output frames into `ready`.
+static void voice_next_grain(voice *v, const Data *data) {
+  float *grain;
+
+  if (v->prev < 0) {
+    // First grain: keep the attack of the step untouched
+    voice_fetch(v, data, 0, STRETCH_WINDOW, v->seg);
+    memcpy(v->ready, v->seg, sizeof(v->ready));
+    dsp_mul(v->tail, v->seg + STRETCH_HOP, stretch_fall, STRETCH_HOP);
+    v->prev = 0;
+    v->nominal = STRETCH_HOP / v->ratio;
+    v->ready_pos = 0;
+    return;
+  }
+
+  // Look around the nominal position for the grain that best continues the
+  // previous one
+  int64_t nominal = (int64_t)v->nominal;
+  int64_t seek_from = nominal - STRETCH_SEEK;
+
+  voice_fetch(v, data, v->prev + STRETCH_HOP, STRETCH_HOP, v->ref);
+  voice_fetch(v, data, seek_from, STRETCH_WINDOW + 2 * STRETCH_SEEK, v->seg);
+
+  size_t best = STRETCH_SEEK;
+  float best_score = dsp_dot(v->seg + best, v->ref, STRETCH_HOP);
+  for (size_t offset = 0; offset <= 2 * STRETCH_SEEK; offset++) {
+    float score = dsp_dot(v->seg + offset, v->ref, STRETCH_HOP);
+    if (score > best_score) {
+      best_score = score;
+      best = offset;
+    }
+  }
+
+  grain = v->seg + best;
+  dsp_mul_add(v->ready, v->tail, grain, stretch_rise, STRETCH_HOP);
+  dsp_mul(v->tail, grain + STRETCH_HOP, stretch_fall, STRETCH_HOP);
+
+  v->prev = seek_from + (int64_t)best;
+  v->nominal += STRETCH_HOP / v->ratio;
+  v->ready_pos = 0;
+}
+
+// Length of [start, end) played at `rate`.
+static inline size_t voice_length(size_t start, size_t end, double rate) {
+  return (size_t)((double)(end - start) / rate);
+}
+
+// Starts playing [start, end) at `rate` and `gain`, stretched by `ratio`.
+void voice_start(voice *v, size_t start, size_t end, double rate, float gain,
+                 double ratio) {
+  v->start = start;
+  v->end = end;
+  v->rate = rate;
+  v->gain = gain;
+  v->length = voice_length(start, end, rate);
+  v->pos = 0;
+  v->ratio = ratio;
+  v->left = v->length;
+
+  if (ratio != 1.0) {
+    v->left = (size_t)((double)v->length * ratio);
+    v->prev = -1;
+    v->ready_pos = STRETCH_HOP;
+  }
+}
+
+static inline bool voice_done(const voice *v) { return v->left == 0; }
+
+// Renders up to `n` frames into `out`. Returns how many were rendered, less
+// than `n` only when the voice is done. RT-safe.
+uint32_t voice_render(voice *v, const Data *data, float *out, uint32_t n) {
+  uint32_t frames = (uint32_t)SPA_MIN((size_t)n, v->left);
+
+  if (v->ratio == 1.0) {
+    voice_read(v, data, v->pos, frames, v->gain, out);
+    v->pos += frames;
+    v->left -= frames;
+    return frames;
+  }
+
+  uint32_t done = 0;
+  while (done < frames) {
+    if (v->ready_pos == STRETCH_HOP) {
+      voice_next_grain(v, data);
+    }
+    uint32_t chunk = SPA_MIN(frames - done, STRETCH_HOP - v->ready_pos);
+    dsp_scale(out + done, v->ready + v->ready_pos, v->gain, chunk);
+    v->ready_pos += chunk;
+    done += chunk;
+  }
+
+  v->left -= frames;
+  return frames;
+}
+
+#endif
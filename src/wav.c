@@ -0,0 +1,263 @@
+#ifndef MBAS_WAV_C
+#define MBAS_WAV_C
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "decode.c"
+#include "dsp.c"
+
+// Minimal RIFF/WAVE reader: finds the `fmt ` and `data` chunks so float WAVs
+// can be mapped as they are, and converts PCM ones.
+
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_FLOAT 0x0003
+#define WAV_FORMAT_EXTENSIBLE 0xfffe
+
+// Frames converted at once
+#define WAV_CHUNK 4096
+
+struct wav_info {
+  uint16_t format;
+  uint16_t channels;
+  uint32_t rate;
+  uint16_t block_align;
+  uint16_t bits;
+  off_t data_offset;
+  size_t data_size;
+};
+
+typedef struct wav_info wav_info;
+
+enum {
+  WAV_NOT_WAV = 0,
+  WAV_OK = 1,
+  WAV_UNSUPPORTED = -1,
+};
+
+static inline uint16_t wav_u16(const unsigned char *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static inline uint32_t wav_u32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static bool wav_read(int fd, void *buffer, size_t size, off_t offset) {
+  return pread(fd, buffer, size, offset) == (ssize_t)size;
+}
+
+// Parses the header of the file in `fd`. Returns WAV_NOT_WAV if it is not a
+// RIFF/WAVE file, and WAV_UNSUPPORTED if it is one this reader cannot play.
+int wav_parse(int fd, wav_info *info) {
+  unsigned char header[12];
+  if (!wav_read(fd, header, sizeof(header), 0) ||
+      memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+    return WAV_NOT_WAV;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    return WAV_UNSUPPORTED;
+  }
+
+  bool has_fmt = false;
+  off_t offset = sizeof(header);
+  unsigned char chunk[8];
+  while (wav_read(fd, chunk, sizeof(chunk), offset)) {
+    uint32_t size = wav_u32(chunk + 4);
+    offset += sizeof(chunk);
+
+    if (memcmp(chunk, "fmt ", 4) == 0) {
+      unsigned char fmt[40] = {0};
+      if (size < 16 || !wav_read(fd, fmt, size < 40 ? size : 40, offset)) {
+        return WAV_UNSUPPORTED;
+      }
+      info->format = wav_u16(fmt);
+      info->channels = wav_u16(fmt + 2);
+      info->rate = wav_u32(fmt + 4);
+      info->block_align = wav_u16(fmt + 12);
+      info->bits = wav_u16(fmt + 14);
+      // The actual format is the start of the sub-format GUID
+      if (info->format == WAV_FORMAT_EXTENSIBLE && size >= 26) {
+        info->format = wav_u16(fmt + 24);
+      }
+      has_fmt = true;
+    } else if (memcmp(chunk, "data", 4) == 0) {
+      if (!has_fmt) {
+        return WAV_UNSUPPORTED;
+      }
+      info->data_offset = offset;
+      // Streamed files leave the size unset, the data runs to the end
+      info->data_size = offset + (off_t)size > st.st_size
+                            ? (size_t)(st.st_size - offset)
+                            : size;
+      break;
+    }
+
+    // Chunks are padded to an even size
+    offset += (off_t)size + (size & 1);
+  }
+
+  if (!has_fmt || info->data_offset == 0) {
+    return WAV_UNSUPPORTED;
+  }
+
+  bool pcm = info->format == WAV_FORMAT_PCM &&
+             (info->bits == 16 || info->bits == 24 || info->bits == 32);
+  bool fp = info->format == WAV_FORMAT_FLOAT && info->bits == 32;
+  if ((!pcm && !fp) || info->channels == 0 || info->rate == 0 ||
+      info->block_align != info->channels * (info->bits / 8)) {
+    return WAV_UNSUPPORTED;
+  }
+
+  return WAV_OK;
+}
+
+// Whether the data chunk can be used as the sample as it is.
+static inline bool wav_is_native(const wav_info *info) {
+  return info->format == WAV_FORMAT_FLOAT && info->channels == 1 &&
+         info->rate == DECODE_RATE && info->data_offset % sizeof(float) == 0;
+}
+
+// Frames of the sample once converted by `wav_convert`.
+static inline size_t wav_frames(const wav_info *info) {
+  size_t n = info->data_size / info->block_align;
+  if (info->rate == DECODE_RATE) {
+    return n;
+  }
+  return decode_resampled_frames(n, (int)info->rate);
+}
+
+typedef int16_t wav_v4s16 __attribute__((vector_size(8)));
+typedef int32_t wav_v4s32 __attribute__((vector_size(16)));
+
+// out[i] = x[i] / 2^15
+static void wav_convert_s16(float *out, const unsigned char *x, size_t n) {
+  v4f scale = v4f_splat(1.0f / 32768.0f);
+  size_t vn = n & ~(size_t)3;
+  for (size_t i = 0; i < vn; i += 4) {
+    wav_v4s16 s;
+    memcpy(&s, x + 2 * i, sizeof(s));
+    v4f_store(out + i, __builtin_convertvector(s, v4f) * scale);
+  }
+  for (size_t i = vn; i < n; i++) {
+    out[i] = (float)(int16_t)wav_u16(x + 2 * i) * (1.0f / 32768.0f);
+  }
+}
+
+// out[i] = x[i] / 2^23. The 3 byte samples are moved to the top of an int32
+// so the sign comes for free.
+static void wav_convert_s24(float *out, const unsigned char *x, size_t n) {
+  v4f scale = v4f_splat(1.0f / 2147483648.0f);
+  size_t vn = n & ~(size_t)3;
+  for (size_t i = 0; i < vn; i += 4) {
+    const unsigned char *p = x + 3 * i;
+    wav_v4s32 s = {
+        (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 |
+                  (uint32_t)p[2] << 24),
+        (int32_t)((uint32_t)p[3] << 8 | (uint32_t)p[4] << 16 |
+                  (uint32_t)p[5] << 24),
+        (int32_t)((uint32_t)p[6] << 8 | (uint32_t)p[7] << 16 |
+                  (uint32_t)p[8] << 24),
+        (int32_t)((uint32_t)p[9] << 8 | (uint32_t)p[10] << 16 |
+                  (uint32_t)p[11] << 24),
+    };
+    v4f_store(out + i, __builtin_convertvector(s, v4f) * scale);
+  }
+  for (size_t i = vn; i < n; i++) {
+    const unsigned char *p = x + 3 * i;
+    int32_t s = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 |
+                          (uint32_t)p[2] << 24);
+    out[i] = (float)s * (1.0f / 2147483648.0f);
+  }
+}
+
+// out[i] = x[i] / 2^31
+static void wav_convert_s32(float *out, const unsigned char *x, size_t n) {
+  v4f scale = v4f_splat(1.0f / 2147483648.0f);
+  size_t vn = n & ~(size_t)3;
+  for (size_t i = 0; i < vn; i += 4) {
+    wav_v4s32 s;
+    memcpy(&s, x + 4 * i, sizeof(s));
+    v4f_store(out + i, __builtin_convertvector(s, v4f) * scale);
+  }
+  for (size_t i = vn; i < n; i++) {
+    out[i] = (float)(int32_t)wav_u32(x + 4 * i) * (1.0f / 2147483648.0f);
+  }
+}
+
+// Converts the data chunk to f32 mono at DECODE_RATE, in a 64 byte aligned
+// buffer. Returns NULL on error.
+float *wav_convert(int fd, const wav_info *info, size_t *frames) {
+  size_t n = info->data_size / info->block_align;
+  size_t channels = info->channels;
+  size_t samples = WAV_CHUNK * channels;
+  unsigned char *raw = (unsigned char *)malloc(WAV_CHUNK * info->block_align);
+  float *interleaved = (float *)malloc(samples * sizeof(float));
+  float *mono = (float *)aligned_alloc(
+      64, ((n * sizeof(float) + 63) & ~(size_t)63) + 64);
+
+  if (!raw || !interleaved || !mono) {
+    goto fail;
+  }
+
+  for (size_t done = 0; done < n; done += WAV_CHUNK) {
+    size_t chunk = n - done < WAV_CHUNK ? n - done : WAV_CHUNK;
+    if (!wav_read(fd, raw, chunk * info->block_align,
+                  info->data_offset + (off_t)(done * info->block_align))) {
+      goto fail;
+    }
+
+    float *out = channels == 1 ? mono + done : interleaved;
+    switch (info->bits) {
+    case 16:
+      wav_convert_s16(out, raw, chunk * channels);
+      break;
+    case 24:
+      wav_convert_s24(out, raw, chunk * channels);
+      break;
+    case 32:
+      if (info->format == WAV_FORMAT_FLOAT) {
+        memcpy(out, raw, chunk * channels * sizeof(float));
+      } else {
+        wav_convert_s32(out, raw, chunk * channels);
+      }
+      break;
+    }
+
+    // Downmix
+    for (size_t i = 0; channels > 1 && i < chunk; i++) {
+      float sum = 0.0f;
+      for (size_t c = 0; c < channels; c++) {
+        sum += interleaved[i * channels + c];
+      }
+      mono[done + i] = sum / (float)channels;
+    }
+  }
+
+  free(raw);
+  free(interleaved);
+
+  if (info->rate != DECODE_RATE) {
+    float *resampled = decode_resample(mono, n, (int)info->rate, frames);
+    free(mono);
+    return resampled;
+  }
+
+  *frames = n;
+  return mono;
+
+fail:
+  free(raw);
+  free(interleaved);
+  free(mono);
+  return NULL;
+}
+
+#endif